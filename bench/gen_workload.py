@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# Generates a synthetic swarm workload: the in<rank>.txt input of every peer.
+#
+# Usage: bench/gen_workload.py [options] [output dir]
+# Every file gets --seeds seeds, picked among all the peers (uniform) or
+# among the first --seeds peers only (hot). Every peer wants --wants files
+# it doesn't seed, picked by their Zipf popularity: the i-th file is wanted
+# with a weight of 1 / i^zipf, so a few files are wanted by most peers.
+
+import argparse
+import hashlib
+import os
+import random
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Synthetic swarm workload generator")
+    parser.add_argument("--ranks", type=int, default=16, help="MPI ranks, trackers included")
+    parser.add_argument("--trackers", type=int, default=1, help="ranks acting as trackers")
+    parser.add_argument("--files", type=int, default=32, help="number of files")
+    parser.add_argument("--segments", default="20:100",
+                        help="segments per file, a count or a min:max range")
+    parser.add_argument("--seeds", type=int, default=1, help="seeds per file")
+    parser.add_argument("--seed-dist", choices=["uniform", "hot"], default="uniform",
+                        help="how the seeds are spread over the peers")
+    parser.add_argument("--wants", type=int, default=4, help="files wanted per peer")
+    parser.add_argument("--zipf", type=float, default=1.0, help="Zipf exponent of the files' popularity")
+    parser.add_argument("--rng-seed", type=int, default=1)
+    parser.add_argument("out_dir", nargs="?", default=".")
+    return parser.parse_args()
+
+
+def segment_range(spec):
+    if ":" in spec:
+        low, high = spec.split(":")
+        return int(low), int(high)
+    return int(spec), int(spec)
+
+
+def pick_weighted(rng, candidates, weights, count):
+    """Picks up to count distinct candidates, by their weights"""
+    candidates, weights = list(candidates), list(weights)
+    picked = []
+    while candidates and len(picked) < count:
+        i = rng.choices(range(len(candidates)), weights=weights)[0]
+        picked.append(candidates.pop(i))
+        weights.pop(i)
+    return picked
+
+
+def main():
+    args = parse_args()
+    rng = random.Random(args.rng_seed)
+    peers = list(range(args.trackers, args.ranks))
+    low, high = segment_range(args.segments)
+
+    files = ["file%d" % i for i in range(1, args.files + 1)]
+    hashes = {}
+    for name in files:
+        count = rng.randint(low, high)
+        hashes[name] = [hashlib.md5(("%s-%d" % (name, j)).encode()).hexdigest() for j in range(count)]
+
+    seed_pool = peers if args.seed_dist == "uniform" else peers[:args.seeds]
+    seeds_of = {name: set(rng.sample(seed_pool, min(args.seeds, len(seed_pool)))) for name in files}
+    popularity = [1 / (i + 1) ** args.zipf for i in range(len(files))]
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    for rank in peers:
+        owned = [name for name in files if rank in seeds_of[name]]
+        candidates = [(name, weight) for name, weight in zip(files, popularity) if rank not in seeds_of[name]]
+        wanted = pick_weighted(rng, [c[0] for c in candidates], [c[1] for c in candidates], args.wants)
+
+        with open(os.path.join(args.out_dir, "in%d.txt" % rank), "w") as out:
+            out.write("%d\n" % len(owned))
+            for name in owned:
+                out.write("%s %d\n" % (name, len(hashes[name])))
+                out.write("".join(h + "\n" for h in hashes[name]))
+            out.write("%d\n" % len(wanted))
+            out.write("".join(name + "\n" for name in wanted))
+
+
+if __name__ == "__main__":
+    main()
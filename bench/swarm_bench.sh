@@ -0,0 +1,59 @@
+#!/bin/bash
+# Runs synthetic swarm workloads at several rank counts and reports the
+# peers' time to completion percentiles, the trackers' request rate and
+# the peers' download rate.
+#
+# Usage: bench/swarm_bench.sh [rank counts...]
+# The workload is made by bench/gen_workload.py, its options can be passed
+# in GEN_ARGS (e.g. GEN_ARGS="--files 64 --zipf 1.2"); the tunables
+# (TRACKERS, TRACKER_SHARDS, DOWNLOAD_WINDOW, SEGMENT_SIZE...) are read
+# from the environment and forwarded to every rank.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+BINARY="$BENCH_DIR/../tema2"
+RANK_COUNTS=${@:-8 16 32}
+TRACKERS=${TRACKERS:-1}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+cd "$WORK_DIR"
+
+FORWARD=""
+for var in TRACKERS TRACKER_SHARDS DOWNLOAD_WINDOW CONCURRENT_FILES UPLOAD_WORKERS \
+           UPLOAD_QUEUE_LIMIT VERIFY_WORKERS NOTIFY_INTERVAL_US SEGMENT_SIZE \
+           ENDGAME_REQUESTS; do
+    if [ -n "${!var}" ]; then
+        FORWARD="$FORWARD -x $var=${!var}"
+    fi
+done
+
+# Prints the p50 / p90 / p99 / max of the numbers read, one per line
+percentiles() {
+    sort -n | awk '{ v[NR] = $1 }
+        END {
+            if (NR == 0) { print "-", "-", "-", "-"; exit }
+            printf "%.4f %.4f %.4f %.4f\n", v[int((NR - 1) * 0.5) + 1], v[int((NR - 1) * 0.9) + 1],
+                   v[int((NR - 1) * 0.99) + 1], v[NR]
+        }'
+}
+
+printf "%-6s %-10s %-10s %-10s %-10s %-14s %s\n" \
+    "ranks" "p50 (s)" "p90 (s)" "p99 (s)" "max (s)" "tracker req/s" "segments/s per peer"
+for ranks in $RANK_COUNTS; do
+    rm -f in*.txt client*
+    "$BENCH_DIR/gen_workload.py" --ranks "$ranks" --trackers "$TRACKERS" $GEN_ARGS .
+    mpirun --oversubscribe -np "$ranks" $FORWARD "$BINARY" 2> stderr.log > /dev/null
+
+    # [Peer r]: Downloaded N segments in Ts, only the peers that wanted something
+    downloads=$(grep "^\[Peer [0-9]*\]: Downloaded" stderr.log | awk '$4 > 0 { t = $7; sub("s", "", t); print $4, t }')
+    read p50 p90 p99 pmax <<< "$(echo "$downloads" | awk 'NF { print $2 }' | percentiles)"
+    peer_rate=$(echo "$downloads" | awk 'NF && $2 > 0 { sum += $1 / $2; n++ } END { printf "%.0f", n ? sum / n : 0 }')
+
+    # [TRACKER r]: Handled N requests in Ts, the trackers run side by side
+    tracker_rate=$(grep "^\[TRACKER [0-9]*\]: Handled" stderr.log | awk '{ t = $7; sub("s", "", t); n += $4; if (t + 0 > max + 0) max = t }
+        END { printf "%.0f", (max > 0 ? n / max : 0) }')
+
+    printf "%-6s %-10s %-10s %-10s %-10s %-14s %s\n" "$ranks" "$p50" "$p90" "$p99" "$pmax" "$tracker_rate" "$peer_rate"
+done
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Measures how many segment requests per second a single hot seed serves
+# with different upload worker counts.
+#
+# Usage: bench/upload_scaling.sh [ranks] [segments] [worker counts...]
+# Every rank but the tracker and the seed (rank 1) downloads the same
+# file from the seed, which reports the requests it served and the time
+# it took when its upload workers finish.
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+BINARY="$BENCH_DIR/../tema2"
+RANKS=${1:-8}
+SEGMENTS=${2:-2000}
+shift 2 2>/dev/null || shift $#
+WORKERS=${@:-1 2 4 8}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+cd "$WORK_DIR"
+
+# The seed owns the whole file, everybody else wants it
+{
+    echo 1
+    echo "hotfile $SEGMENTS"
+    for ((i = 0; i < SEGMENTS; i++)); do
+        printf "%032x\n" "$i"
+    done
+    echo 0
+} > in1.txt
+for ((r = 2; r < RANKS; r++)); do
+    printf "0\n1\nhotfile\n" > "in$r.txt"
+done
+
+printf "%-8s %-10s %-10s %s\n" "workers" "requests" "seconds" "requests/s"
+for workers in $WORKERS; do
+    rm -f client*
+    mpirun --oversubscribe -np "$RANKS" -x UPLOAD_WORKERS="$workers" "$BINARY" \
+        2> stderr.log > /dev/null
+    grep "^\[Peer 1\]: Served" stderr.log | awk -v w="$workers" \
+        '{ secs = $7; sub("s", "", secs); printf "%-8s %-10s %-10s %.0f\n", w, $4, secs, (secs > 0 ? $4 / secs : 0) }'
+done
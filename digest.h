@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+/* Digest of a segment's payload, it follows XXH64: four independent lanes
+ * consume the payload in 32 byte stripes, so their multiplies don't wait
+ * on each other and the loop runs at memory speed, then the lanes are
+ * merged and the result is avalanched
+ * It's not a cryptographic hash, it catches corrupted / wrong segments,
+ * not forged ones */
+
+static const uint64_t DIGEST_PRIME1 = 11400714785074694791ULL;
+static const uint64_t DIGEST_PRIME2 = 14029467366897019727ULL;
+static const uint64_t DIGEST_PRIME3 = 1609587929392839161ULL;
+static const uint64_t DIGEST_PRIME4 = 9650029242287828579ULL;
+static const uint64_t DIGEST_PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t digest_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t digest_read64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t digest_round(uint64_t acc, uint64_t input) {
+    acc += input * DIGEST_PRIME2;
+    acc = digest_rotl(acc, 31);
+    return acc * DIGEST_PRIME1;
+}
+
+static inline uint64_t digest_merge_round(uint64_t acc, uint64_t lane) {
+    acc ^= digest_round(0, lane);
+    return acc * DIGEST_PRIME1 + DIGEST_PRIME4;
+}
+
+static inline uint64_t payload_digest(const char *data, size_t size) {
+    const char *p = data;
+    const char *end = data + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t lanes[4] = {
+            DIGEST_PRIME1 + DIGEST_PRIME2, DIGEST_PRIME2, 0, 0 - DIGEST_PRIME1
+        };
+        for (; p + 32 <= end; p += 32) {
+            for (int lane = 0; lane < 4; lane++) {
+                lanes[lane] = digest_round(lanes[lane], digest_read64(p + 8 * lane));
+            }
+        }
+        h = digest_rotl(lanes[0], 1) + digest_rotl(lanes[1], 7)
+            + digest_rotl(lanes[2], 12) + digest_rotl(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            h = digest_merge_round(h, lanes[lane]);
+        }
+    } else {
+        h = DIGEST_PRIME5;
+    }
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= digest_round(0, digest_read64(p));
+        h = digest_rotl(h, 27) * DIGEST_PRIME1 + DIGEST_PRIME4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * DIGEST_PRIME1;
+        h = digest_rotl(h, 23) * DIGEST_PRIME2 + DIGEST_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (uint64_t)(unsigned char)*p * DIGEST_PRIME5;
+        h = digest_rotl(h, 11) * DIGEST_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= DIGEST_PRIME2;
+    h ^= h >> 29;
+    h *= DIGEST_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
@@ -9,6 +9,9 @@
 #include "peer.h"
 #include "tracker.h"
 #include "utils.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "trace.h"
 
 
 int main(int argc, char *argv[]) {
@@ -22,14 +25,27 @@ int main(int argc, char *argv[]) {
     }
     MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    init_protocol_datatypes();
 
-    if (rank == TRACKER_RANK) {
-		auto tracker = Tracker(numtasks);
+    /* The first tracker_count ranks are trackers, the trackers and the
+     * peers get their own communicator for the collectives only they take part in */
+    int tracker_count = min(get_config_value("TRACKERS", DEFAULT_TRACKERS), numtasks - 1);
+    bool is_tracker = rank < TRACKER_RANK + tracker_count;
+    MPI_Comm role_comm;
+    MPI_Comm_split(MPI_COMM_WORLD, is_tracker ? 0 : 1, rank, &role_comm);
+    trace_init(is_tracker ? "Tracker" : "Peer");
+
+    if (is_tracker) {
+		auto tracker = Tracker(numtasks, rank, tracker_count, role_comm);
         tracker.init();
     } else {
-		auto peer = Peer(numtasks, rank);
+		auto peer = Peer(numtasks, rank, tracker_count, role_comm);
         peer.init();
     }
+    MPI_Comm_free(&role_comm);
+    export_metrics();
+    export_trace();
     MPI_Barrier(MPI_COMM_WORLD);
+    free_protocol_datatypes();
     MPI_Finalize();
 }
@@ -0,0 +1,110 @@
+#include <memory>
+
+#include "metrics.h"
+
+using namespace std;
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "segments_downloaded",
+    "segment_nacks",
+    "segment_busy_replies",
+    "segment_verify_failures",
+    "upload_requests_served",
+    "upload_requests_rejected",
+    "tracker_requests",
+    "swarm_notifications",
+    "haves_sent",
+    "haves_received",
+    "endgame_requests",
+    "duplicate_answers"
+};
+
+static const char *histogram_names[HISTOGRAM_COUNT] = {
+    "segment_rtt_us",
+    "tracker_handler_time_us",
+    "upload_queue_lock_wait_us",
+    "payload_verify_time_us"
+};
+
+/* Every thread's block, they outlive their threads so they can be summed up */
+static mutex registry_mtx;
+static vector<unique_ptr<metrics_block>> registry;
+
+metrics_block &thread_metrics() {
+    thread_local metrics_block *block = NULL;
+    if (block == NULL) {
+        unique_ptr<metrics_block> new_block(new metrics_block());
+        block = new_block.get();
+        lock_guard<mutex> lock(registry_mtx);
+        registry.push_back(move(new_block));
+    }
+    return *block;
+}
+
+/* The upper bound, in microseconds, of the bucket the p-th percentile falls in */
+static uint64_t histogram_percentile(const uint64_t *buckets, uint64_t count, double p) {
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen > 0 && seen >= p * count) {
+            return 2ULL << bucket;
+        }
+    }
+    return 0;
+}
+
+static void write_metrics(const string &path, int numtasks, const metrics_block &total,
+                          const uint64_t *max_counters) {
+    ofstream out(path);
+    out << "{\n  \"ranks\": " << numtasks << ",\n  \"counters\": {\n";
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        out << "    \"" << counter_names[c] << "\": {\"total\": " << total.counters[c]
+            << ", \"max_per_rank\": " << max_counters[c] << "}" << (c + 1 < COUNTER_COUNT ? "," : "") << "\n";
+    }
+    out << "  },\n  \"histograms\": {\n";
+    for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+        uint64_t count = 0;
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            count += total.buckets[h][bucket];
+        }
+        out << "    \"" << histogram_names[h] << "\": {\"count\": " << count
+            << ", \"mean\": " << (count ? (double)total.sums_us[h] / count : 0)
+            << ", \"p50\": " << histogram_percentile(total.buckets[h], count, 0.5)
+            << ", \"p90\": " << histogram_percentile(total.buckets[h], count, 0.9)
+            << ", \"p99\": " << histogram_percentile(total.buckets[h], count, 0.99)
+            << ", \"buckets\": [";
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            out << total.buckets[h][bucket] << (bucket + 1 < HISTOGRAM_BUCKETS ? ", " : "");
+        }
+        out << "]}" << (h + 1 < HISTOGRAM_COUNT ? "," : "") << "\n";
+    }
+    out << "  }\n}\n";
+}
+
+void export_metrics() {
+    int rank, numtasks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+
+    /* The block is a flat array of uint64_t, so it's reduced as one */
+    const int words = sizeof(metrics_block) / sizeof(uint64_t);
+    metrics_block local = {};
+    for (auto &block : registry) {
+        uint64_t *dst = (uint64_t *)&local;
+        const uint64_t *src = (const uint64_t *)block.get();
+        for (int i = 0; i < words; i++) {
+            dst[i] += src[i];
+        }
+    }
+
+    metrics_block total = {};
+    uint64_t max_counters[COUNTER_COUNT] = {};
+    CHECK_MPI_RET(MPI_Reduce(&local, &total, words, MPI_UINT64_T, MPI_SUM, TRACKER_RANK, MPI_COMM_WORLD));
+    CHECK_MPI_RET(MPI_Reduce(local.counters, max_counters, COUNTER_COUNT, MPI_UINT64_T, MPI_MAX,
+                             TRACKER_RANK, MPI_COMM_WORLD));
+
+    if (rank == TRACKER_RANK) {
+        const char *path = getenv("METRICS_FILE");
+        write_metrics(path != NULL ? path : "metrics.json", numtasks, total, max_counters);
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+
+#include "utils.h"
+
+using namespace std;
+
+/* Counters and latency histograms of the hot paths
+ * Every thread records into its own block, with plain increments and no
+ * locks; the blocks are only summed up at shutdown, once all the threads
+ * were joined, then reduced across the ranks and written as JSON */
+
+enum metric_counter {
+    SEGMENTS_DOWNLOADED,
+    SEGMENT_NACKS,
+    SEGMENT_BUSY_REPLIES,
+    SEGMENT_VERIFY_FAILURES,
+    UPLOAD_REQUESTS_SERVED,
+    UPLOAD_REQUESTS_REJECTED,
+    TRACKER_REQUESTS,
+    SWARM_NOTIFICATIONS,
+    HAVES_SENT,
+    HAVES_RECEIVED,
+    ENDGAME_REQUESTS,
+    DUPLICATE_ANSWERS,
+    COUNTER_COUNT
+};
+
+enum metric_histogram {
+    SEGMENT_RTT,
+    TRACKER_HANDLER_TIME,
+    UPLOAD_QUEUE_LOCK_WAIT,
+    PAYLOAD_VERIFY_TIME,
+    HISTOGRAM_COUNT
+};
+
+/* Bucket b counts the samples in [2^b, 2^(b+1)) microseconds, bucket 0
+ * also the ones under a microsecond */
+#define HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t buckets[HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t sums_us[HISTOGRAM_COUNT];
+} metrics_block;
+
+/* The calling thread's block, registered on its first use */
+metrics_block &thread_metrics();
+
+static inline double metrics_now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void count_metric(metric_counter counter, uint64_t n = 1) {
+    thread_metrics().counters[counter] += n;
+}
+
+static inline void record_latency(metric_histogram histogram, double seconds) {
+    uint64_t us = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+    int bucket = us == 0 ? 0 : min(63 - __builtin_clzll(us), HISTOGRAM_BUCKETS - 1);
+    metrics_block &block = thread_metrics();
+    block.buckets[histogram][bucket]++;
+    block.sums_us[histogram] += us;
+}
+
+/* Sums this rank's blocks and reduces them on TRACKER_RANK, which writes
+ * them to METRICS_FILE (metrics.json by default)
+ * Collective, every rank must call it after its threads were joined */
+void export_metrics();
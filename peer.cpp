@@ -1,7 +1,13 @@
+#include <sys/stat.h>
+#include <ctype.h>
+
 #include "peer.h"
 
 using namespace std;
 
+/* Weight of the newest sample in the owners' moving averages */
+static const double STATS_SMOOTHING = 0.2;
+
 /* Encapsulates the Client's workflow in a single function for 
  * better readability */
 void Peer::init() {
@@ -10,330 +16,1456 @@ void Peer::init() {
     send_owned_files_to_tracker();
 	
 	wait_for_initial_ack();
+
+	init_owned_files();
     
 	start_and_join_threads();
 }
 
-/* Wait for the tracker's ACK until we start the download / upload threads */
+/* Wait for the tracker's ACK until we start the download / upload threads
+ * The ACK is broadcast by the first tracker and carries the file table: [header(ACK, count, tag = shards)][file_entry x count],
+ * a file's id is its position in the table */
 void Peer::wait_for_initial_ack() {
-    int ack;
-    CHECK_MPI_RET(MPI_Recv(&ack, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    if (ack != 1) {
+    vector<char> buf;
+    broadcast_message(buf, TRACKER_RANK);
+
+    const char *cursor = buf.data();
+    msg_header header;
+    unpack(cursor, &header);
+    if (header.type != ACK) {
         cerr << "Tracker did not send OK message." << endl;
         exit(-1);
     }
+
+    tracker_shards = header.tag;
+    file_names.resize(header.count);
+    file_trackers.resize(header.count);
+    file_segment_counts.resize(header.count);
+    for (int file_id = 0; file_id < header.count; file_id++) {
+        file_entry entry;
+        unpack(cursor, &entry);
+        file_names[file_id] = entry.name;
+        file_segment_counts[file_id] = entry.segment_count;
+        file_ids[entry.name] = file_id;
+        file_trackers[file_id] = TRACKER_RANK + ring.owner(entry.name);
+    }
     cerr << "Got the ACK: " << rank << endl;
 }
 
+/* Builds the ownership store once the file ids are known, the seeded
+ * files are fully owned from the start */
+void Peer::init_owned_files() {
+    owned_files.reset(new file_segments[file_names.size()]);
+    for (int file_id = 0; file_id < (int)file_names.size(); file_id++) {
+        owned_files[file_id].init(file_segment_counts[file_id]);
+    }
+    for (auto &[file_name, hashes] : seed_files) {
+        auto file_it = file_ids.find(file_name);
+        if (file_it == file_ids.end()) {
+            continue;
+        }
+        int file_id = file_it->second;
+        file_segments &segments = owned_files[file_id];
+        segments.set_hashes(hashes);
+        if (segment_size > 0) {
+            /* The seeded payload is only kept in memory */
+            map_file_payload(file_id, "");
+            for (int seg_idx = 0; seg_idx < segments.segment_count; seg_idx++) {
+                make_segment_payload(segments.segment_payload(seg_idx), hashes[seg_idx], segment_size);
+            }
+        }
+        segments.mark_all_owned();
+    }
+}
+
+/* The digests of a seeded file's payloads, none if only the hashes move */
+vector<uint64_t> Peer::payload_digests(const vector<segment_hash> &hashes) {
+    vector<uint64_t> digests;
+    if (segment_size == 0) {
+        return digests;
+    }
+    vector<char> payload(segment_size);
+    for (auto &hash : hashes) {
+        make_segment_payload(payload.data(), hash, segment_size);
+        digests.push_back(payload_digest(payload.data(), segment_size));
+    }
+    return digests;
+}
+
+/* Maps the region every segment of the file is received into / sent from */
+void Peer::map_file_payload(int file_id, const string &path) {
+    if (!owned_files[file_id].map_payload(path, segment_size)) {
+        cerr << "[Peer " << rank << "]: Could not map the payload of file " << file_names[file_id] << endl;
+        exit(-1);
+    }
+}
+
 void Peer::start_and_join_threads() {
     thread download_thread(&Peer::download_thread_func, this);
     thread upload_thread(&Peer::upload_thread_func, this);
+    thread writer_thread(&Peer::writer_thread_func, this);
+    vector<thread> upload_workers;
+    for (int i = 0; i < upload_worker_count; i++) {
+        upload_workers.emplace_back(&Peer::upload_worker_func, this);
+    }
+    /* Only real payloads need verifying */
+    vector<thread> verify_workers;
+    for (int i = 0; segment_size > 0 && i < verify_worker_count; i++) {
+        verify_workers.emplace_back(&Peer::verify_worker_func, this);
+    }
 
     download_thread.join();
+    {
+        lock_guard<mutex> lock(verify_mtx);
+        verify_done = true;
+    }
+    verify_jobs_cv.notify_all();
+    for (auto &worker : verify_workers) {
+        worker.join();
+    }
+    {
+        lock_guard<mutex> lock(write_mtx);
+        write_done = true;
+    }
+    write_jobs_cv.notify_all();
+    writer_thread.join();
+    /* The notifications are sent synchronously and every tracker waits for
+     * its shards' ones to be received before TERMINATE is sent, the ones
+     * pushed right before we unsubscribed can still be on their way */
+    while (1) {
+        apply_swarm_notifications();
+        {
+            lock_guard<mutex> lock(upload_jobs_mtx);
+            if (upload_done) {
+                break;
+            }
+        }
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
     upload_thread.join();
+    for (auto &worker : upload_workers) {
+        worker.join();
+    }
+
+    double serving_time = last_served_time - first_served_time;
+    cerr << "[Peer " << rank << "]: Served " << served_requests << " requests in "
+         << serving_time << "s with " << upload_worker_count << " upload workers" << endl;
 }
 
+/* The download thread's function, downloads up to concurrent_files wanted
+ * files at once; their segment requests share the download_window slots,
+ * so a slow or scarce file doesn't stall all the others */
 void Peer::download_thread_func() {
-    /* Loop through all the wanted files */
-    for (auto &wanted_file_name : wanted_files) {
-        /* Get this file's swarm for the tracker */
-        cerr << "[Peer " << rank << "]: Requesting swarm for file " << wanted_file_name << endl;
-        req_file_swarm_from_tracker(wanted_file_name);
-        vector<int> file_owners = recv_file_swarm_from_tracker(wanted_file_name);
-        cerr << "[Peer " << rank << "]: Got swarm for file " << wanted_file_name << " received." << endl;
-        cerr << "Swarm for file " << wanted_file_name << " is: ";
-        for (auto owner : file_owners) {
-            cerr << owner << " ";
-        }
-        cerr << endl;
-
-        if (file_owners.empty()) {
-            cerr << "[Peer " << rank << "]: No swarm found for file "
-                 << wanted_file_name << ". Cannot download.\n";
-            continue;
-        }
+    trace_thread_name("download");
+    double start_time = MPI_Wtime();
+    downloads.resize(wanted_files.size());
+    /* Each window slot owns one response tag so answers can be
+     * matched even if they arrive out of order */
+    request_slots.resize(download_window);
+    response_reqs.assign(download_window, MPI_REQUEST_NULL);
+    for (int slot = download_window - 1; slot >= 0; slot--) {
+        free_slots.push_back(slot);
+    }
+    discard_bufs.resize(download_window);
+    owners_stats.assign(num_tasks, owner_stats{0, 0, 0, 0});
 
-        /* Get the list of all the needed segments */
-        vector<string> hashes_to_acquire = wanted_files_hashes[wanted_file_name];
-        int total_segments_for_file = (int)hashes_to_acquire.size();
-
-        /* Download each segment of a file in a round-robin manner 
-		 * so no single seed / peer of this file will get too busy */
-        for (int seg_idx = 0; seg_idx < total_segments_for_file; seg_idx++) {
-            string &segment_hash = hashes_to_acquire[seg_idx];
-
-            bool segment_downloaded = false;
-			/* The attempt count */
-            int iteration = 0;
-
-            while (!segment_downloaded && iteration < (int)file_owners.size()) {
-                /* Decide the Round-Robin index */
-				int peer_index = (seg_idx + iteration) % file_owners.size();
-                int target_peer = file_owners[peer_index];
-                /* We can't download from ourselves a wanted segment as we know
-				 * for sure we don't have it and it also doesn't make sense */
-				if (target_peer == rank) {
-                    iteration++;
-                    continue;
-                }
+    /* The wanted files currently being downloaded */
+    vector<int> active_downloads;
+    int next_file = 0;
 
-                string buf = wanted_file_name + " " + segment_hash;
-                int size = (int)buf.size();
-
-                /* Send the segment's hash size */
-                CHECK_MPI_RET(MPI_Send(&size, 1, MPI_INT, target_peer, UPLOAD_TAG, MPI_COMM_WORLD));
-                cerr << "[Peer " << rank << "]: Requesting segment " 
-                     << segment_hash << " from peer " << target_peer << endl;
-
-                /* Send the buffer containing the wanted segment's hash */
-                CHECK_MPI_RET(MPI_Send(buf.c_str(), buf.size(), MPI_CHAR, target_peer, UPLOAD_TAG, MPI_COMM_WORLD));
-
-                /* Wait the peer's / seed's response */
-                int response;
-                CHECK_MPI_RET(MPI_Recv(&response, 1, MPI_INT, target_peer, DOWNLOAD_TAG,MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-
-                if (response == ACK) {
-                    /* Only add the this segment to the owned list if a peer / seeds
-					 * sent us an ACK */
-                    cerr << "[Peer " << rank << "]: Successfully downloaded segment "
-                         << segment_hash << " from peer " << target_peer << endl;
-					/* Update the owned hashes of the files in a mutually exclusive way for 
-					 * synchronizing with the upload thread */
-					owned_files_mtx.lock();
-					owned_files[wanted_file_name].push_back(segment_hash);
-					owned_files_mtx.unlock();
-                    segment_count++;
-                    segment_downloaded = true;
-
-                    /* After downloading 10 segments, request the swarm again from the tracker
-					 * as new seeds / peers may have entered this file's swarm */
-                    if (segment_count % 10 == 0) {
-						/* Notify the tracker we can also act as a peer for this file */
-                        send_peer_update_to_tracker(wanted_file_name);
-						/* Send the new swarm request */
-                        req_file_swarm_from_tracker(wanted_file_name);
-						/* Update the file's swarm */
-                        file_owners = recv_file_swarm_from_tracker(wanted_file_name);
-                    }
-                } else if (response == !ACK){
-					/* If we got a NACK, we'll loop again until we get an ACK
-					 * from a seed / peer for this segment, until the segment_downloaded
-					 * flag gets set to true */
-                    cerr << "DENIED" << endl;
-                }
-                iteration++;
+    while (1) {
+        /* Start the next wanted files while there is room for them */
+        while ((int)active_downloads.size() < concurrent_files && next_file < (int)wanted_files.size()) {
+            if (start_file_download(next_file)) {
+                active_downloads.push_back(next_file);
             }
+            next_file++;
+        }
+        if (active_downloads.empty()) {
+            break;
+        }
+
+        /* Use the owners the tracker pushed and the other owners gossiped right away */
+        apply_swarm_notifications();
+        apply_peer_haves();
+        process_verified_segments();
+        fill_download_window(active_downloads);
 
-            if (!segment_downloaded) {
-                cerr << "[Peer " << rank << "] Failed to download segment "
-                     << segment_hash << " of file " << wanted_file_name << endl;
+        /* Finish the files that have nothing left to request or wait for */
+        bool finished_any = false;
+        for (auto it = active_downloads.begin(); it != active_downloads.end();) {
+            file_download &download = downloads[*it];
+            if (download_settled(*it)) {
+                finish_file_download(download);
+                it = active_downloads.erase(it);
+                finished_any = true;
+            } else {
+                ++it;
             }
         }
+        if (finished_any) {
+            continue;
+        }
 
-        /* Notifiy the tracker that this client finished downloading a whole file 
-		 * so the tracker can mark it as a seed for this file */
-        send_download_completed_to_tracker(wanted_file_name);
-		/* Write the file's segments to disk */
-        save_file(wanted_file_name);
+        wait_for_download_progress();
+    }
+    /* The ignored endgame answers are still coming, their owners
+     * are blocked sending them */
+    while ((int)free_slots.size() < download_window) {
+        wait_for_download_progress();
     }
 
     /* After there are no more files to download, notify the tracker that this client finished */
     cerr << "[Peer " << rank << "]: Finished all downloads." << endl;
+    cerr << "[Peer " << rank << "]: Downloaded " << segment_count << " segments in "
+         << MPI_Wtime() - start_time << "s" << endl;
     send_all_downloads_completed_to_tracker();
+    finish_gossip();
 }
 
-/* Signals the tracker that this client has finished downloading
- * ALL of its wanted files */
+/* Gets a wanted file's swarm and queues all of its segments, rarest first
+ * Returns false if nobody owns the file */
+bool Peer::start_file_download(int download_idx) {
+    file_download &download = downloads[download_idx];
+    download.file_name = wanted_files[download_idx];
+    auto file_it = file_ids.find(download.file_name);
+    if (file_it == file_ids.end()) {
+        cerr << "[Peer " << rank << "]: No swarm found for file "
+             << download.file_name << ". Cannot download.\n";
+        return false;
+    }
+    download.file_id = file_it->second;
+    download.in_flight = 0;
+    download.verifying = 0;
+    download.swarm_version = 0;
+    download_of_file[download.file_id] = download_idx;
+
+    /* Get this file's swarm for the tracker and subscribe to its changes */
+    LOG_DEBUG("[Peer " << rank << "]: Requesting swarm for file " << download.file_name);
+    {
+        trace_scope span("swarm request", download.file_id, file_trackers[download.file_id]);
+        req_file_swarm_from_tracker(download, true);
+        recv_file_swarm_from_tracker(download);
+    }
+    download.swarm_refreshed = true;
+
+    if (download.owners.empty()) {
+        cerr << "[Peer " << rank << "]: No swarm found for file "
+             << download.file_name << ". Cannot download.\n";
+        return false;
+    }
+
+    open_file_output(download);
+
+    /* The segments are received straight into the output file */
+    if (segment_size > 0) {
+        map_file_payload(download.file_id, "client" + to_string(rank) + "_" + download.file_name + ".data");
+    }
+
+    /* Segments that still have to be requested, rarest first, NACKed ones
+     * are pushed back in front so they get retried from another owner */
+    int total_segments_for_file = owned_files[download.file_id].segment_count;
+    download.attempts.assign(total_segments_for_file, 0);
+    download.received.assign(total_segments_for_file, false);
+    for (int seg_idx = 0; seg_idx < total_segments_for_file; seg_idx++) {
+        download.pending_segments.push_back(seg_idx);
+    }
+    sort_rarest_first(download.pending_segments, download.availability);
+    return true;
+}
+
+/* Estimates how long an owner will take to answer a new request: its
+ * average round trip, scaled by the requests we already have queued on it
+ * and by how often it NACKs us (a NACK means asking someone else after it)
+ * Owners that answered BUSY are only picked once everyone else is busy too */
+double Peer::expected_response_time(int owner, double now) {
+    owner_stats &stats = owners_stats[owner];
+    double expected = stats.avg_rtt * (1 + stats.outstanding) / max(1 - stats.nack_rate, 0.1);
+    if (stats.busy_until > now) {
+        expected += 1 + (stats.busy_until - now);
+    }
+    return expected;
+}
+
+/* Picks the owner of a segment expected to answer fastest
+ * Peers that only own part of the file may NACK, and the swarm may
+ * change between attempts, so every owner gets a few rounds:
+ * the owners that may have it and didn't NACK it yet are asked first,
+ * once they all did they are asked again, and only if none of them
+ * is known to have it the gossip is ignored
+ * Returns -1 if the segment ran out of attempts */
+int Peer::pick_segment_owner(file_download &download, int seg_idx) {
+    if (download.attempts[seg_idx] >= SEGMENT_ATTEMPT_ROUNDS * (int)download.owners.size()) {
+        return -1;
+    }
+
+    int owner = fastest_segment_owner(download, seg_idx, true);
+    if (owner != -1) {
+        return owner;
+    }
+    /* Everyone that may have it NACKed this segment, start a new round */
+    download.nacked_by[seg_idx].clear();
+    owner = fastest_segment_owner(download, seg_idx, true);
+    if (owner != -1) {
+        return owner;
+    }
+    return fastest_segment_owner(download, seg_idx, false);
+}
+
+/* The owner expected to answer fastest, skipping the ones that already
+ * NACKed this segment in its current round and, trusting the gossip,
+ * the ones that gossiped they don't have it
+ * Owners without any samples yet are expected to be fast, so every
+ * owner gets tried; ties go round-robin by the segment index so equally
+ * good owners share the load
+ * Returns -1 if no owner is left to ask */
+int Peer::fastest_segment_owner(file_download &download, int seg_idx, bool trust_gossip) {
+    vector<int> &file_owners = download.owners;
+    int owner_count = file_owners.size();
+    vector<int> &nacked = download.nacked_by[seg_idx];
+    double now = MPI_Wtime();
+
+    int best_owner = -1;
+    double best_time = 0;
+    for (int i = 0; i < owner_count; i++) {
+        int owner = file_owners[(seg_idx + i) % owner_count];
+        /* We can't download from ourselves a wanted segment as we know
+         * for sure we don't have it and it also doesn't make sense */
+        if (owner == rank || find(nacked.begin(), nacked.end(), owner) != nacked.end()) {
+            continue;
+        }
+        if (trust_gossip && !may_own(download, owner, seg_idx)) {
+            continue;
+        }
+        double expected = expected_response_time(owner, now);
+        if (best_owner == -1 || expected < best_time) {
+            best_owner = owner;
+            best_time = expected;
+        }
+    }
+    return best_owner;
+}
+
+/* Whether an owner may have a segment: the seeds have them all, the
+ * other owners only the ones they gossiped, if they gossiped at all */
+bool Peer::may_own(file_download &download, int owner, int seg_idx) {
+    auto it = download.owner_bits.find(owner);
+    if (it == download.owner_bits.end()) {
+        return true;
+    }
+    return (it->second[seg_idx / 64] >> (seg_idx % 64)) & 1;
+}
+
+/* Updates the moving averages of the owner that answered a request */
+void Peer::update_owner_stats(segment_request &req) {
+    owner_stats &stats = owners_stats[req.owner];
+    double now = MPI_Wtime();
+    double rtt = now - req.send_time;
+    record_latency(SEGMENT_RTT, rtt);
+    stats.outstanding--;
+    stats.avg_rtt = stats.avg_rtt == 0 ? rtt : (1 - STATS_SMOOTHING) * stats.avg_rtt + STATS_SMOOTHING * rtt;
+    stats.nack_rate = (1 - STATS_SMOOTHING) * stats.nack_rate + STATS_SMOOTHING * (req.response != ACK);
+    /* Back off for a couple of round trips from an overloaded owner */
+    if (req.response == BUSY) {
+        stats.busy_until = now + 2 * stats.avg_rtt;
+    }
+}
+
+/* Sends a request for the file's next pending segment on a free window slot
+ * Returns false if there was nothing left to request, or only segments
+ * whose owners are backing off */
+bool Peer::request_next_segment(int download_idx) {
+    file_download &download = downloads[download_idx];
+    const vector<segment_hash> &hashes_to_acquire = owned_files[download.file_id].hashes;
+    /* The segments whose owners all asked us to back off, they keep their place */
+    vector<int> backed_off;
+    bool sent = false;
+
+    while (!download.pending_segments.empty()) {
+        int seg_idx = download.pending_segments.front();
+        download.pending_segments.pop_front();
+
+        int target_peer = pick_segment_owner(download, seg_idx);
+        if (target_peer == -1 && !download.swarm_refreshed) {
+            /* The tracker may know owners it didn't push yet */
+            refresh_swarm(download);
+            target_peer = pick_segment_owner(download, seg_idx);
+        }
+        if (target_peer == -1) {
+            cerr << "[Peer " << rank << "] Failed to download segment "
+                 << segment_hash_to_string(hashes_to_acquire[seg_idx])
+                 << " of file " << download.file_name << endl;
+            continue;
+        }
+        /* Every owner that may have it asked us to back off, don't spin
+         * on their BUSY answers, try the next segment and ask again once
+         * they're due */
+        if (owners_stats[target_peer].busy_until > MPI_Wtime()) {
+            backed_off.push_back(seg_idx);
+            continue;
+        }
+
+        send_request_on_free_slot(download_idx, seg_idx, target_peer);
+        sent = true;
+        break;
+    }
+    for (auto it = backed_off.rbegin(); it != backed_off.rend(); ++it) {
+        download.pending_segments.push_front(*it);
+    }
+    return sent;
+}
+
+/* Endgame: once all of a file's remaining segments are in flight, the free
+ * slots ask other owners for them too, so the file's tail doesn't wait on a
+ * single slow owner; the first ACK is taken and the other answers ignored
+ * A segment is requested from up to endgame_requests owners at once
+ * Returns false if there was nothing left to request */
+bool Peer::request_endgame_segment(int download_idx) {
+    file_download &download = downloads[download_idx];
+    if (!download.pending_segments.empty() || download.in_flight == 0) {
+        return false;
+    }
+
+    /* The owners every remaining segment is requested from */
+    unordered_map<int, vector<int>> asked;
+    for (int slot = 0; slot < download_window; slot++) {
+        segment_request &req = request_slots[slot];
+        if (response_reqs[slot] != MPI_REQUEST_NULL && req.download_idx == download_idx
+            && !download.received[req.seg_idx]) {
+            asked[req.seg_idx].push_back(req.owner);
+        }
+    }
+
+    double now = MPI_Wtime();
+    for (auto &[seg_idx, asked_owners] : asked) {
+        if ((int)asked_owners.size() >= endgame_requests) {
+            continue;
+        }
+        vector<int> &nacked = download.nacked_by[seg_idx];
+        int best_owner = -1;
+        double best_time = 0;
+        for (auto owner : download.owners) {
+            /* The duplicates don't go to the owners that asked us to back off */
+            if (owner == rank || find(asked_owners.begin(), asked_owners.end(), owner) != asked_owners.end()
+                || find(nacked.begin(), nacked.end(), owner) != nacked.end() || !may_own(download, owner, seg_idx)
+                || owners_stats[owner].busy_until > now) {
+                continue;
+            }
+            double expected = expected_response_time(owner, now);
+            if (best_owner == -1 || expected < best_time) {
+                best_owner = owner;
+                best_time = expected;
+            }
+        }
+        if (best_owner != -1) {
+            count_metric(ENDGAME_REQUESTS);
+            send_request_on_free_slot(download_idx, seg_idx, best_owner);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Peer::send_request_on_free_slot(int download_idx, int seg_idx, int owner) {
+    file_download &download = downloads[download_idx];
+    const segment_hash &hash = owned_files[download.file_id].hashes[seg_idx];
+
+    int slot = free_slots.back();
+    free_slots.pop_back();
+    request_slots[slot].download_idx = download_idx;
+    request_slots[slot].seg_idx = seg_idx;
+    request_slots[slot].owner = owner;
+    request_slots[slot].send_time = MPI_Wtime();
+    owners_stats[owner].outstanding++;
+    LOG_DEBUG("[Peer " << rank << "]: Requesting segment "
+              << segment_hash_to_string(hash) << " from peer " << owner);
+    send_segment_request(request_slots[slot], download.file_id, hash, slot, &response_reqs[slot]);
+    download.in_flight++;
+}
+
+/* Whether a segment still has a request in flight, an answered slot's
+ * request is already MPI_REQUEST_NULL */
+bool Peer::segment_in_flight(int download_idx, int seg_idx) {
+    for (int slot = 0; slot < download_window; slot++) {
+        if (response_reqs[slot] != MPI_REQUEST_NULL && request_slots[slot].download_idx == download_idx
+            && request_slots[slot].seg_idx == seg_idx) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Queues a segment to be requested again, unless an endgame
+ * request for it is still in flight */
+void Peer::requeue_segment(file_download &download, int download_idx, int seg_idx) {
+    if (!segment_in_flight(download_idx, seg_idx)) {
+        download.pending_segments.push_front(seg_idx);
+    }
+}
+
+/* Whether a file has nothing left to request or wait for, the
+ * ignored endgame answers still in flight don't count */
+bool Peer::download_settled(int download_idx) {
+    file_download &download = downloads[download_idx];
+    if (!download.pending_segments.empty() || download.verifying > 0) {
+        return false;
+    }
+    for (int slot = 0; download.in_flight > 0 && slot < download_window; slot++) {
+        segment_request &req = request_slots[slot];
+        if (response_reqs[slot] != MPI_REQUEST_NULL && req.download_idx == download_idx
+            && (req.claimed || !download.received[req.seg_idx])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Fills the free window slots taking one segment from every
+ * active file in turn, so they all share the window fairly
+ * Only the slots left over go to the files' endgame requests */
+void Peer::fill_download_window(vector<int> &active_downloads) {
+    bool requested = true;
+    while (!free_slots.empty() && requested) {
+        requested = false;
+        for (int i = 0; i < (int)active_downloads.size() && !free_slots.empty(); i++) {
+            int download_idx = active_downloads[(next_download_turn + i) % active_downloads.size()];
+            requested |= request_next_segment(download_idx);
+        }
+        next_download_turn++;
+    }
+
+    requested = true;
+    while (!free_slots.empty() && requested) {
+        requested = false;
+        for (int i = 0; i < (int)active_downloads.size() && !free_slots.empty(); i++) {
+            requested |= request_endgame_segment(active_downloads[i]);
+        }
+    }
+}
+
+/* Handles the ACK / NACK received on a window slot
+ * When real data moves, an ACK is followed by the segment's payload on the
+ * same tag, which is received right into the segment's place in the file;
+ * the slot stays busy until the payload arrived too
+ * The first ACK for a segment claims it, the other answers for it (the
+ * endgame's duplicate requests) are ignored, their payloads are received
+ * aside and dropped */
+void Peer::handle_segment_response(int slot) {
+    segment_request &req = request_slots[slot];
+    CHECK_MPI_RET(MPI_Wait(&req.send_req, MPI_STATUS_IGNORE));
+
+    file_download &download = downloads[req.download_idx];
+    file_segments &segments = owned_files[download.file_id];
+    if (req.response == ACK && segment_size > 0 && !req.receiving_payload) {
+        req.receiving_payload = true;
+        char *payload = segments.segment_payload(req.seg_idx);
+        if (download.received[req.seg_idx]) {
+            discard_bufs[slot].resize(segment_size);
+            payload = discard_bufs[slot].data();
+        } else {
+            download.received[req.seg_idx] = true;
+            req.claimed = true;
+        }
+        CHECK_MPI_RET(MPI_Irecv(payload, segment_size, MPI_BYTE, req.owner,
+                                SEGMENT_RESPONSE_TAG + slot, MPI_COMM_WORLD, &response_reqs[slot]));
+        return;
+    }
+    free_slots.push_back(slot);
+
+    update_owner_stats(req);
+    /* A payload received aside is ignored even if the verification of the
+     * claimed one failed since */
+    bool duplicate = !req.claimed && (download.received[req.seg_idx] || req.receiving_payload);
+    if (trace_enabled) {
+        const char *span = duplicate ? "segment duplicate" : req.response == ACK ? "segment ACK"
+                           : req.response == BUSY ? "segment BUSY" : "segment NACK";
+        trace_record(span, req.send_time, MPI_Wtime(), download.file_id, req.owner);
+    }
+
+    download.in_flight--;
+
+    if (duplicate) {
+        count_metric(DUPLICATE_ANSWERS);
+        if (!download.received[req.seg_idx]) {
+            requeue_segment(download, req.download_idx, req.seg_idx);
+        }
+    } else if (req.response == BUSY) {
+        /* The owner is overloaded, it doesn't count as an attempt, just
+         * ask the one expected to answer fastest instead */
+        count_metric(SEGMENT_BUSY_REPLIES);
+        requeue_segment(download, req.download_idx, req.seg_idx);
+    } else if (req.response == ACK) {
+        download.received[req.seg_idx] = true;
+        download.attempts[req.seg_idx]++;
+        download.nacked_by.erase(req.seg_idx);
+        /* A payload is only ours once it matches its digest */
+        if (segment_size > 0 && !download.digests.empty()) {
+            queue_verification(req);
+        } else {
+            segment_acquired(download, req.seg_idx, req.owner);
+        }
+    } else {
+        /* If we got a NACK, retry this segment from the next owner
+         * until one of them sends us an ACK */
+        LOG_DEBUG("DENIED");
+        count_metric(SEGMENT_NACKS);
+        download.attempts[req.seg_idx]++;
+        download.nacked_by[req.seg_idx].push_back(req.owner);
+        requeue_segment(download, req.download_idx, req.seg_idx);
+    }
+}
+
+/* Waits for any of the outstanding requests to be answered
+ * While payloads are being verified, the requests are only polled, so the
+ * verified segments are also picked up as soon as they're handed back */
+void Peer::wait_for_download_progress() {
+    int slot;
+    if (verifying == 0) {
+        CHECK_MPI_RET(MPI_Waitany(download_window, response_reqs.data(), &slot, MPI_STATUS_IGNORE));
+        if (slot != MPI_UNDEFINED) {
+            handle_segment_response(slot);
+        } else {
+            /* Nothing in flight, we're backing off from busy owners */
+            this_thread::sleep_for(chrono::microseconds(50));
+        }
+        return;
+    }
+
+    int flag;
+    CHECK_MPI_RET(MPI_Testany(download_window, response_reqs.data(), &slot, &flag, MPI_STATUS_IGNORE));
+    if (flag && slot != MPI_UNDEFINED) {
+        handle_segment_response(slot);
+        return;
+    }
+    unique_lock<mutex> lock(verify_mtx);
+    verified_jobs_cv.wait_for(lock, chrono::microseconds(50), [this] { return !verified_jobs.empty(); });
+}
+
+/* A segment was received (and verified, if it carries a payload) */
+void Peer::segment_acquired(file_download &download, int seg_idx, int owner) {
+    file_segments &segments = owned_files[download.file_id];
+    /* Only add the this segment to the owned list if a peer / seeds
+     * sent us an ACK and its payload, if any, was verified */
+    LOG_DEBUG("[Peer " << rank << "]: Successfully downloaded segment "
+              << segment_hash_to_string(segments.hashes[seg_idx]) << " from peer " << owner);
+    count_metric(SEGMENTS_DOWNLOADED);
+    /* Publish the segment to the upload thread with an atomic bit set */
+    segments.mark_owned(seg_idx);
+    segment_count++;
+    queue_segment_write(download, seg_idx);
+
+    /* After downloading 10 segments, notify the tracker we can also act
+     * as a peer for this file; new seeds / peers entering this file's swarm
+     * are pushed by the tracker and the owners downloading it gossip their
+     * new segments to each other, so the availability is kept up to date
+     * here and the tracker is never asked for the swarm again */
+    if (segment_count % 10 == 0) {
+        send_peer_update_to_tracker(download.file_id);
+    }
+    download.unannounced.push_back(seg_idx);
+    if ((int)download.unannounced.size() >= HAVE_BATCH_SEGMENTS) {
+        announce_segments(download);
+    }
+    if (segment_count % AVAILABILITY_REFRESH_SEGMENTS == 0) {
+        sort_rarest_first(download.pending_segments, download.availability);
+    }
+}
+
+/* Hands a received payload to the verify workers, the segment stays
+ * unowned until it's handed back */
+void Peer::queue_verification(segment_request &req) {
+    file_download &download = downloads[req.download_idx];
+    verify_job job;
+    job.download_idx = req.download_idx;
+    job.seg_idx = req.seg_idx;
+    job.owner = req.owner;
+    job.expected_digest = download.digests[req.seg_idx];
+    job.payload = owned_files[download.file_id].segment_payload(req.seg_idx);
+    job.valid = false;
+    {
+        lock_guard<mutex> lock(verify_mtx);
+        verify_jobs.push_back(job);
+    }
+    verify_jobs_cv.notify_one();
+    download.verifying++;
+    verifying++;
+}
+
+/* Takes the segments the verify workers handed back, a payload that doesn't
+ * match its digest is requested again from another owner */
+void Peer::process_verified_segments() {
+    if (verifying == 0) {
+        return;
+    }
+    deque<verify_job> verified;
+    {
+        lock_guard<mutex> lock(verify_mtx);
+        verified.swap(verified_jobs);
+    }
+    for (auto &job : verified) {
+        file_download &download = downloads[job.download_idx];
+        download.verifying--;
+        verifying--;
+        if (job.valid) {
+            segment_acquired(download, job.seg_idx, job.owner);
+            continue;
+        }
+        cerr << "[Peer " << rank << "]: Segment "
+             << segment_hash_to_string(owned_files[download.file_id].hashes[job.seg_idx])
+             << " from peer " << job.owner << " failed verification" << endl;
+        count_metric(SEGMENT_VERIFY_FAILURES);
+        download.received[job.seg_idx] = false;
+        download.nacked_by[job.seg_idx].push_back(job.owner);
+        requeue_segment(download, job.download_idx, job.seg_idx);
+    }
+}
+
+/* A verify worker's function, hashes the received payloads until the
+ * download thread is done */
+void Peer::verify_worker_func() {
+    trace_thread_name("verify worker");
+    while (1) {
+        verify_job job;
+        {
+            unique_lock<mutex> lock(verify_mtx);
+            verify_jobs_cv.wait(lock, [this] { return verify_done || !verify_jobs.empty(); });
+            if (verify_jobs.empty()) {
+                break;
+            }
+            job = verify_jobs.front();
+            verify_jobs.pop_front();
+        }
+
+        double verify_start = metrics_now();
+        {
+            trace_scope span("verify", -1, job.owner);
+            job.valid = payload_digest(job.payload, segment_size) == job.expected_digest;
+        }
+        record_latency(PAYLOAD_VERIFY_TIME, metrics_now() - verify_start);
+        {
+            lock_guard<mutex> lock(verify_mtx);
+            verified_jobs.push_back(job);
+        }
+        verified_jobs_cv.notify_one();
+    }
+}
+
+void Peer::finish_file_download(file_download &download) {
+    /* Notifiy the tracker that this client finished downloading a whole file 
+     * so the tracker can mark it as a seed for this file */
+    send_download_completed_to_tracker(download.file_id);
+    /* The file's segments were already queued for the writer as they came */
+    close_file_output(download);
+}
+
+/* Sends a nonblocking request for a segment to an owner and posts the
+ * receive for its answer on the window slot's response tag
+ * The request's message lives in the slot until the answer arrives */
+void Peer::send_segment_request(segment_request &req, int file_id, const segment_hash &hash,
+                                int slot, MPI_Request *response_req) {
+    int response_tag = SEGMENT_RESPONSE_TAG + slot;
+    req.msg.header = make_header(SEGMENT_REQUEST, file_id, 0, response_tag);
+    req.msg.hash = hash;
+    req.receiving_payload = false;
+    req.claimed = false;
+
+    CHECK_MPI_RET(MPI_Irecv(&req.response, 1, MPI_INT, req.owner, response_tag, MPI_COMM_WORLD, response_req));
+    CHECK_MPI_RET(MPI_Isend(&req.msg, 1, MPI_SEGMENT_REQUEST, req.owner, UPLOAD_TAG, MPI_COMM_WORLD, &req.send_req));
+}
+
+/* The tag of the tracker shard that owns the file */
+int Peer::tracker_tag_of(int file_id) {
+    return TRACKER_SHARD_TAG + file_id % tracker_shards;
+}
+
+/* Sends a request to the tracker as a single message, the header alone
+ * carries the action and the file it refers to */
+void Peer::send_header_to_tracker(int type, int file_id) {
+    msg_header header = make_header(type, file_id);
+    vector<char> buf;
+    pack(buf, &header);
+    send_message(buf, file_trackers[file_id], tracker_tag_of(file_id));
+}
+
+/* Signals the home tracker that this client has finished downloading
+ * ALL of its wanted files
+ * Every shard of every tracker gets the signal too, after all the updates
+ * we sent it, so a shard knows it received everything once all the
+ * clients are done */
 void Peer::send_all_downloads_completed_to_tracker() {
-    int action = CLIENT_GOT_ALL_FILES;
-    CHECK_MPI_RET(MPI_Send(&action, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
+    msg_header header = make_header(CLIENT_GOT_ALL_FILES);
+    vector<char> buf;
+    pack(buf, &header);
+    for (int tracker = TRACKER_RANK; tracker < TRACKER_RANK + tracker_count; tracker++) {
+        for (int shard = 0; shard < tracker_shards; shard++) {
+            send_message(buf, tracker, TRACKER_SHARD_TAG + shard);
+        }
+    }
+    send_message(buf, home_tracker, TRACKER_TAG);
 }
 
-/* Notifies the tracker that this client can act as a peer for a certain file */
-void Peer::send_peer_update_to_tracker(string file_name) {
-    string buffer = file_name;
-    int size = (int)buffer.size();
-    int action = PEER_UPDATE;
-    CHECK_MPI_RET(MPI_Send(&action, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
-    CHECK_MPI_RET(MPI_Send(&size, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
-    CHECK_MPI_RET(MPI_Send(buffer.c_str(), buffer.size(), MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
+/* Notifies the tracker that this client can act as a peer for a certain file
+ * [header(count = words)][uint64_t ownership bitfield x words], the tracker
+ * uses the bitfield to count how many owners every segment has */
+void Peer::send_peer_update_to_tracker(int file_id) {
+    vector<uint64_t> bitfield = owned_files[file_id].snapshot_bitfield();
+
+    vector<char> buf;
+    msg_header header = make_header(PEER_UPDATE, file_id, bitfield.size());
+    pack(buf, &header);
+    pack(buf, bitfield.data(), bitfield.size());
+    send_message(buf, file_trackers[file_id], tracker_tag_of(file_id));
+}
+
+/* Stable sorts the segments by their owner count, after shuffling them
+ * so equally rare segments are picked in a different order by every peer */
+void Peer::sort_rarest_first(deque<int> &segments, const vector<int> &availability) {
+    shuffle(segments.begin(), segments.end(), rng);
+    stable_sort(segments.begin(), segments.end(), [&availability](int a, int b) {
+        return availability[a] < availability[b];
+    });
 }
 
 /* Signals the tracker that this client has finished downloading
  * a single wanted file */
-void Peer::send_download_completed_to_tracker(string file_name) {
-    string buf = file_name;
-    int action = SINGLE_FILE_DOWNLOAD_COMPLETED;
-    CHECK_MPI_RET(MPI_Send(&action, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
-    int size = (int)buf.size();
-    CHECK_MPI_RET(MPI_Send(&size, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
-    CHECK_MPI_RET(MPI_Send(buf.c_str(), buf.size(), MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
+void Peer::send_download_completed_to_tracker(int file_id) {
+    send_header_to_tracker(SINGLE_FILE_DOWNLOAD_COMPLETED, file_id);
 }
 
 /* The upload thread's function, polls any message recevied with the 
- * UPLOAD_TAG and manages the file transfer 
+ * UPLOAD_TAG and hands the requests to the upload workers, which
+ * manage the file transfer
  * This thread can also receive the terminate procedure init from
  * the tracker that signals it to stop as there's no need to 
- * seed / peer any files as all clients have finished downloading */
+ * seed / peer any files as all clients have finished downloading,
+ * it then wakes up all the workers so they can finish too */
 void Peer::upload_thread_func() {
+    trace_thread_name("upload");
     while (1) {
-        int size;
+        upload_job job;
         MPI_Status status;
-        CHECK_MPI_RET(MPI_Recv(&size, 1, MPI_INT, MPI_ANY_SOURCE, UPLOAD_TAG, MPI_COMM_WORLD, &status));
-        int source = status.MPI_SOURCE;
+        CHECK_MPI_RET(MPI_Recv(&job.request, 1, MPI_SEGMENT_REQUEST, MPI_ANY_SOURCE, UPLOAD_TAG, MPI_COMM_WORLD, &status));
+        job.source = status.MPI_SOURCE;
 
-        vector<char> buf(size + 1);
-        CHECK_MPI_RET(MPI_Recv(buf.data(), size, MPI_CHAR, source, UPLOAD_TAG, MPI_COMM_WORLD, &status));
-        buf[size] = '\0';
-
-        string file_name;
-        string segment_hash;
-		stringstream ss(buf.data());
-		ss >> file_name >> segment_hash;
+        if (job.request.header.type == TERMINATE) {
+            break;
+        }
 
-        cerr << "[Peer " << rank << "]: Received request for segment from file "
-             << file_name << " from peer " << source << endl;
+        LOG_DEBUG("[Peer " << rank << "]: Received request for segment from file "
+                  << file_names[job.request.header.file_id] << " from peer " << job.source);
 
-        if (file_name == "TERMINATE") {
-            break;
+        bool queued = false;
+        {
+            double lock_start = metrics_now();
+            lock_guard<mutex> lock(upload_jobs_mtx);
+            record_latency(UPLOAD_QUEUE_LOCK_WAIT, metrics_now() - lock_start);
+            if ((int)upload_jobs.size() < upload_queue_limit) {
+                upload_jobs.push_back(job);
+                queued = true;
+            }
+        }
+        if (queued) {
+            upload_jobs_cv.notify_one();
+        } else {
+            /* Push back on the requester when the workers can't keep up */
+            count_metric(UPLOAD_REQUESTS_REJECTED);
+            int busy = BUSY;
+            CHECK_MPI_RET(MPI_Send(&busy, 1, MPI_INT, job.source, job.request.header.tag, MPI_COMM_WORLD));
         }
-		int ack = check_if_segment_is_owned(file_name, segment_hash);
-		cerr << "[Peer " << rank << "]: Checked if I got segment " << segment_hash
-				<< " for peer " << source << endl;
-		CHECK_MPI_RET(MPI_Send(&ack, 1, MPI_INT, source, DOWNLOAD_TAG, MPI_COMM_WORLD));	
 	}
+
+    {
+        lock_guard<mutex> lock(upload_jobs_mtx);
+        upload_done = true;
+    }
+    upload_jobs_cv.notify_all();
     cerr << "[Peer " << rank << "]: Terminating upload thread." << endl;
 }
 
-/* Checks if we have that file's segment hash in a mutually exclusive manner 
- * returns an ACK / NACK accordingly */
-int Peer::check_if_segment_is_owned(string file_name, string segment_hash) {
-	int ack;
-	/* Check the owned hashes of the files in a mutually exclusive way for 
-	 * synchronizing with the download thread */
-	owned_files_mtx.lock();
+/* An upload worker's function, serves the queued requests until the
+ * upload thread got TERMINATE and the queue has been drained
+ * Workers only read the lock-free ownership store and send on the
+ * requester's own response tag, so any number of them can run at once */
+void Peer::upload_worker_func() {
+    trace_thread_name("upload worker");
+    while (1) {
+        upload_job job;
+        {
+            unique_lock<mutex> lock(upload_jobs_mtx);
+            upload_jobs_cv.wait(lock, [this] { return upload_done || !upload_jobs.empty(); });
+            if (upload_jobs.empty()) {
+                break;
+            }
+            job = upload_jobs.front();
+            upload_jobs.pop_front();
+        }
+
+		int seg_idx;
+		int file_id = job.request.header.file_id;
+		trace_scope span("upload serve", file_id, job.source);
+		int ack = check_if_segment_is_owned(file_id, job.request.hash, &seg_idx);
+		LOG_DEBUG("[Peer " << rank << "]: Checked if I got segment " << segment_hash_to_string(job.request.hash)
+				  << " for peer " << job.source);
+		CHECK_MPI_RET(MPI_Send(&ack, 1, MPI_INT, job.source, job.request.header.tag, MPI_COMM_WORLD));
+		/* The payload is sent straight from its mapped region */
+		if (ack == ACK && segment_size > 0) {
+			CHECK_MPI_RET(MPI_Send(owned_files[file_id].segment_payload(seg_idx), segment_size, MPI_BYTE,
+								   job.source, job.request.header.tag, MPI_COMM_WORLD));
+		}
+
+        count_metric(UPLOAD_REQUESTS_SERVED);
+        long long served = ++served_requests;
+        /* Time the serving from the first request to the last one */
+        if (served == 1) {
+            first_served_time = MPI_Wtime();
+        }
+        last_served_time = MPI_Wtime();
+	}
+}
+
+/* Checks if we have that file's segment hash, without taking any lock
+ * as the download thread only ever publishes segments with atomic bit sets
+ * returns an ACK / NACK accordingly and the segment's index */
+int Peer::check_if_segment_is_owned(int file_id, const segment_hash &hash, int *seg_idx) {
+	file_segments &segments = owned_files[file_id];
 	/* Check if we have the wanted segment, if yes send ACK, if not send NACK */
-	if (find(owned_files[file_name].begin(), owned_files[file_name].end(), segment_hash)
-			!= owned_files[file_name].end()) 
-	{
-		ack = ACK;
-	} else {
-		ack = !ACK;
-		
+	*seg_idx = segments.index_of(hash);
+	if (*seg_idx != -1 && segments.owns(*seg_idx)) {
+		return ACK;
 	}
-	owned_files_mtx.unlock();
-	return ack;
+	return !ACK;
+}
+
+/* A whitespace separated token of the mapped input file */
+typedef struct {
+    const char *start;
+    size_t len;
+} input_token;
+
+/* Returns the next token of the input, an empty one at its end */
+static input_token next_input_token(const char *&cursor, const char *end) {
+    while (cursor < end && isspace((unsigned char)*cursor)) {
+        cursor++;
+    }
+    const char *start = cursor;
+    while (cursor < end && !isspace((unsigned char)*cursor)) {
+        cursor++;
+    }
+    return input_token{start, (size_t)(cursor - start)};
+}
+
+static int input_token_to_int(const input_token &token) {
+    int value = 0;
+    for (size_t i = 0; i < token.len && isdigit((unsigned char)token.start[i]); i++) {
+        value = value * 10 + (token.start[i] - '0');
+    }
+    return value;
+}
+
+/* File names travel in fixed width entries, the longer ones are skipped
+ * rather than truncated into a different name */
+static bool valid_file_name(const input_token &token, int rank) {
+    if (token.len <= MAX_FILENAME - 1) {
+        return true;
+    }
+    cerr << "[Peer " << rank << "]: File name " << string(token.start, token.len)
+         << " is longer than " << MAX_FILENAME - 1 << " characters, skipping it" << endl;
+    return false;
+}
+
+/* Same for the hashes, two longer ones sharing a prefix would become one segment */
+static bool valid_segment_hash(const input_token &token, const input_token &file_name, int rank) {
+    if (token.len <= HASH_SIZE) {
+        return true;
+    }
+    cerr << "[Peer " << rank << "]: Segment hash " << string(token.start, token.len) << " of file "
+         << string(file_name.start, file_name.len) << " is longer than " << HASH_SIZE
+         << " characters, skipping the file" << endl;
+    return false;
 }
 
 /* Peer's initiate by firstly parsing their respective input file 
  * and storing the file content (segment hashes) of the files for which
- * they will act as seeds and the list of the files-to-download */
+ * they will act as seeds and the list of the files-to-download
+ * The input is mapped and parsed in a single pass, the hashes are copied
+ * straight from the mapping into their fixed width form and the
+ * containers are sized from the counts in the file */
 void Peer::parse_initial_files() {
-    ifstream fin("in" + to_string(rank) + ".txt");
-    int segment_nr;
-    string file_name;
-    string segment_hash;
-    int file_count;
+    string path = "in" + to_string(rank) + ".txt";
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat input_stat;
+    if (fd < 0 || fstat(fd, &input_stat) != 0) {
+        cerr << "[Peer " << rank << "]: Could not open " << path << endl;
+        exit(-1);
+    }
+    size_t size = input_stat.st_size;
+    const char *input = NULL;
+    if (size > 0) {
+        void *region = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (region == MAP_FAILED) {
+            cerr << "[Peer " << rank << "]: Could not map " << path << endl;
+            exit(-1);
+        }
+        input = (const char *)region;
+    }
+    close(fd);
+
+    const char *cursor = input;
+    const char *end = input + size;
+
     /* Parses files for which this client will act as seed */
-    fin >> file_count;
+    int file_count = input_token_to_int(next_input_token(cursor, end));
+    seed_files.reserve(file_count);
     for (int i = 0; i < file_count; i++) {
-        fin >> file_name >> segment_nr;
+        input_token file_name = next_input_token(cursor, end);
+        int segment_nr = input_token_to_int(next_input_token(cursor, end));
+        bool valid = valid_file_name(file_name, rank);
+        vector<segment_hash> hashes;
+        hashes.reserve(valid ? segment_nr : 0);
         for (int j = 1; j <= segment_nr; j++) {
-            fin >> segment_hash;
-            owned_files[file_name].push_back(segment_hash);
+            input_token hash = next_input_token(cursor, end);
+            if (!valid) {
+                continue;
+            }
+            if (!valid_segment_hash(hash, file_name, rank)) {
+                valid = false;
+                continue;
+            }
+            hashes.push_back(make_segment_hash(hash.start, hash.len));
+        }
+        if (valid) {
+            seed_files[string(file_name.start, file_name.len)] = move(hashes);
         }
     }
 
     /* Parses the files that this client will download from other peers / seeds */
-    fin >> file_count;
+    file_count = input_token_to_int(next_input_token(cursor, end));
+    wanted_files.reserve(file_count);
     for (int i = 0; i < file_count; i++) {
-        fin >> file_name;
-        wanted_files.push_back(file_name);
+        input_token file_name = next_input_token(cursor, end);
+        if (valid_file_name(file_name, rank)) {
+            wanted_files.push_back(string(file_name.start, file_name.len));
+        }
+    }
+
+    if (input != NULL) {
+        munmap((void *)input, size);
     }
-    fin.close();
 }
 
 /* Receives a file's swarm for the tracker
- * The tracker's response will containt a list of peers / seeds
- * associated with that file, but also a list of all the segment
- * hashes of that file.
- * NOTE: The client will NOT use these hashes for "downloading", but
- * will only use them so it knows what segments it needs to request
- * from the peers / seeds */
-vector<int> Peer::recv_file_swarm_from_tracker(string file_name) {
-    int buf_size;
-    CHECK_MPI_RET(MPI_Recv(&buf_size, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-
-    vector<char> response_buf(buf_size + 1);
-    CHECK_MPI_RET(MPI_Recv(response_buf.data(), buf_size, MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    response_buf[buf_size] = '\0';
-
-    /* Parse the swarm */
-    vector<int> file_owners;
-	stringstream file_owners_str(response_buf.data());
-	int owners_count;
-	file_owners_str >> owners_count;
-	for (int i = 0; i < owners_count; i++) {
-		int client_rank;
-		file_owners_str >> client_rank;
-		file_owners.emplace_back(client_rank);
-	}
+ * The tracker's response will containt the changes of the file's swarm
+ * since the version we last saw, the list of all the segment hashes of
+ * that file and its payloads' digests (only the first time) and how many
+ * owners every segment has:
+ * [header(count = changes, tag = version)][swarm_change x count][int hash_count]
+ * [segment_hash x hash_count][int digest_count][uint64_t digest x digest_count]
+ * [int segment_count][int availability x segment_count]
+ * The hashes tell the client what segments it needs to request from the
+ * peers / seeds, the digests are what the received payloads are checked against */
+void Peer::recv_file_swarm_from_tracker(file_download &download) {
+    vector<char> response_buf = recv_message(file_trackers[download.file_id], TRACKER_TAG);
 
-	/* Get this file's segment hashes if we don't have it already 
-		* This is needed because we may request a swarm for a file multiple
-		* times, [i.e. the 10 segment rule] */
-	if (wanted_files_hashes[file_name].empty()) {
-		int segment_count;
-		file_owners_str >> segment_count;
-		for (int i = 0; i < segment_count; i++) {
-			string segment_hash;
-			file_owners_str >> segment_hash;
-			wanted_files_hashes[file_name].push_back(segment_hash);
+    /* Apply the swarm's changes */
+    const char *cursor = response_buf.data();
+    msg_header header;
+    unpack(cursor, &header);
+    vector<swarm_change> changes(header.count);
+    unpack(cursor, changes.data(), header.count);
+    apply_swarm_changes(download, changes, header.tag);
+
+	/* Get this file's segment hashes, they are only sent with the first
+	 * swarm as we may request a swarm for a file multiple times,
+	 * [i.e. when a segment runs out of owners to ask] */
+	int hash_count;
+	unpack(cursor, &hash_count);
+	file_segments &segments = owned_files[download.file_id];
+	if (hash_count > 0) {
+		vector<segment_hash> hashes(hash_count);
+		unpack(cursor, hashes.data(), hash_count);
+		/* Build the hash -> index map, it's published to the upload
+		 * thread only once it's complete */
+		if (!segments.has_hashes()) {
+			segments.set_hashes(hashes);
 		}
 	}
-    return file_owners;
+
+	/* and the digests the received payloads are verified against */
+	int digest_count;
+	unpack(cursor, &digest_count);
+	if (digest_count > 0) {
+		download.digests.resize(digest_count);
+		unpack(cursor, download.digests.data(), digest_count);
+	}
+
+	int segment_count;
+	unpack(cursor, &segment_count);
+	download.availability.resize(segment_count);
+	unpack(cursor, download.availability.data(), segment_count);
+}
+
+/* Applies swarm changes to a file's owners, applying a change twice
+ * (i.e. pushed by the tracker and also received with a swarm) is harmless
+ * An owner that became a seed has every segment, the ones it didn't
+ * gossip are one more owner for their availability */
+void Peer::apply_swarm_changes(file_download &download, const vector<swarm_change> &changes, int version) {
+    vector<int> &file_owners = download.owners;
+    for (auto &change : changes) {
+        auto it = find(file_owners.begin(), file_owners.end(), change.rank);
+        if (change.added && it == file_owners.end()) {
+            file_owners.push_back(change.rank);
+        } else if (!change.added && it != file_owners.end()) {
+            file_owners.erase(it);
+        }
+        vector<int> &seeds = download.seeds;
+        if (change.added != SWARM_SEED || find(seeds.begin(), seeds.end(), change.rank) != seeds.end()) {
+            continue;
+        }
+        seeds.push_back(change.rank);
+        bool gossiped = download.owner_bits.count(change.rank) > 0;
+        for (int seg_idx = 0; seg_idx < (int)download.availability.size(); seg_idx++) {
+            if (!gossiped || !may_own(download, change.rank, seg_idx)) {
+                download.availability[seg_idx]++;
+            }
+        }
+        download.owner_bits.erase(change.rank);
+    }
+    download.swarm_version = max(download.swarm_version, version);
+    /* A new change may have come with owners the last re-request didn't know of */
+    if (!changes.empty()) {
+        download.swarm_refreshed = false;
+    }
+}
+
+/* Re-requests a file's swarm with the version we last saw, its changes
+ * since then come along with the current availability */
+void Peer::refresh_swarm(file_download &download) {
+    trace_scope span("swarm request", download.file_id, file_trackers[download.file_id]);
+    req_file_swarm_from_tracker(download);
+    recv_file_swarm_from_tracker(download);
+    download.swarm_refreshed = true;
+}
+
+/* Applies every swarm change the tracker pushed since the last call
+ * [header(SWARM_NOTIFY, count = changes, tag = version)][swarm_change x count] */
+void Peer::apply_swarm_notifications() {
+    vector<char> notification;
+    while (try_recv_message(MPI_ANY_SOURCE, SWARM_NOTIFY_TAG, notification)) {
+        const char *cursor = notification.data();
+        msg_header header;
+        unpack(cursor, &header);
+        vector<swarm_change> changes(header.count);
+        unpack(cursor, changes.data(), header.count);
+
+        auto it = download_of_file.find(header.file_id);
+        if (it != download_of_file.end()) {
+            apply_swarm_changes(downloads[it->second], changes, header.tag);
+        }
+    }
+}
+
+/* Records a segment an owner gossiped, it's one more owner for its availability */
+void Peer::learn_owner_segment(file_download &download, int owner, int seg_idx) {
+    vector<uint64_t> &bits = download.owner_bits[owner];
+    if (bits.empty()) {
+        bits.resize((owned_files[download.file_id].segment_count + 63) / 64, 0);
+    }
+    uint64_t mask = 1ULL << (seg_idx % 64);
+    if (bits[seg_idx / 64] & mask) {
+        return;
+    }
+    bits[seg_idx / 64] |= mask;
+    if (seg_idx < (int)download.availability.size()) {
+        download.availability[seg_idx]++;
+    }
+}
+
+/* Applies every HAVE / HAVE_BITFIELD the other owners gossiped since the
+ * last call, a sender the tracker didn't tell us about yet is an owner
+ * from now on
+ * [header(HAVE, count = segments)][int seg_idx x count] or
+ * [header(HAVE_BITFIELD, count = words)][uint64_t bitfield x count] */
+void Peer::apply_peer_haves() {
+    vector<char> message;
+    MPI_Status status;
+    while (try_recv_message(MPI_ANY_SOURCE, HAVE_TAG, message, &status)) {
+        count_metric(HAVES_RECEIVED);
+        const char *cursor = message.data();
+        msg_header header;
+        unpack(cursor, &header);
+
+        auto it = download_of_file.find(header.file_id);
+        if (it == download_of_file.end()) {
+            continue;
+        }
+        file_download &download = downloads[it->second];
+        int owner = status.MPI_SOURCE;
+        /* A seed's late HAVEs don't tell anything new */
+        if (find(download.seeds.begin(), download.seeds.end(), owner) != download.seeds.end()) {
+            continue;
+        }
+        if (find(download.owners.begin(), download.owners.end(), owner) == download.owners.end()) {
+            download.owners.push_back(owner);
+        }
+
+        int segment_count = owned_files[download.file_id].segment_count;
+        if (header.type == HAVE_BITFIELD) {
+            vector<uint64_t> bitfield(header.count);
+            unpack(cursor, bitfield.data(), header.count);
+            for (int seg_idx = 0; seg_idx < segment_count && seg_idx / 64 < header.count; seg_idx++) {
+                if ((bitfield[seg_idx / 64] >> (seg_idx % 64)) & 1) {
+                    learn_owner_segment(download, owner, seg_idx);
+                }
+            }
+        } else {
+            vector<int> segments(header.count);
+            unpack(cursor, segments.data(), header.count);
+            for (auto seg_idx : segments) {
+                learn_owner_segment(download, owner, seg_idx);
+            }
+        }
+    }
+}
+
+/* Gossips the file's segments acquired since the last HAVE to the owners
+ * still downloading it (the ones that aren't seeds), so they only ask us
+ * for segments we have; an owner we never gossiped with gets our whole
+ * bitfield instead, with the segments announced before it joined */
+void Peer::announce_segments(file_download &download) {
+    drop_completed_sends(gossip_reqs, gossip_bufs);
+    vector<char> have, bitfield;
+    for (auto owner : download.owners) {
+        if (owner == rank || find(download.seeds.begin(), download.seeds.end(), owner) != download.seeds.end()) {
+            continue;
+        }
+        vector<int> &gossip_peers = download.gossip_peers;
+        if (find(gossip_peers.begin(), gossip_peers.end(), owner) != gossip_peers.end()) {
+            if (have.empty()) {
+                msg_header header = make_header(HAVE, download.file_id, download.unannounced.size());
+                pack(have, &header);
+                pack(have, download.unannounced.data(), download.unannounced.size());
+            }
+            send_gossip(vector<char>(have), owner);
+            continue;
+        }
+        if (bitfield.empty()) {
+            vector<uint64_t> bits = owned_files[download.file_id].snapshot_bitfield();
+            msg_header header = make_header(HAVE_BITFIELD, download.file_id, bits.size());
+            pack(bitfield, &header);
+            pack(bitfield, bits.data(), bits.size());
+        }
+        send_gossip(vector<char>(bitfield), owner);
+        gossip_peers.push_back(owner);
+    }
+    download.unannounced.clear();
+}
+
+/* Sends a HAVE without waiting for it to be received, the buffer is kept
+ * until it was */
+void Peer::send_gossip(vector<char> &&buf, int dest) {
+    count_metric(HAVES_SENT);
+    gossip_bufs.push_back(move(buf));
+    gossip_reqs.push_back(MPI_REQUEST_NULL);
+    vector<char> &message = gossip_bufs.back();
+    CHECK_MPI_RET(MPI_Issend(message.data(), message.size(), MPI_BYTE, dest, HAVE_TAG, MPI_COMM_WORLD,
+                             &gossip_reqs.back()));
 }
 
-/* Requests a file's swarm from the tracker 
- * Firstly send the action type, then
- * the file name string size, then the file name */
-void Peer::req_file_swarm_from_tracker(string file_name) {
-    int file_name_size = (int)file_name.size();
+/* Keeps receiving the HAVEs sent to us until no peer has any left in flight
+ * Once our own HAVEs were all received we enter a nonblocking barrier of the
+ * peers, when it completes every peer's HAVEs were received, so none is
+ * left behind for MPI_Finalize */
+void Peer::finish_gossip() {
+    MPI_Request barrier;
+    bool in_barrier = false;
+    int done = 0;
+    while (!done) {
+        apply_peer_haves();
+        if (!in_barrier) {
+            drop_completed_sends(gossip_reqs, gossip_bufs);
+            if (gossip_reqs.empty()) {
+                CHECK_MPI_RET(MPI_Ibarrier(peer_comm, &barrier));
+                in_barrier = true;
+            }
+        } else {
+            CHECK_MPI_RET(MPI_Test(&barrier, &done, MPI_STATUS_IGNORE));
+        }
+        if (!done) {
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+    }
+}
 
-    int action = SWARM_REQUEST;
-    CHECK_MPI_RET(MPI_Send(&action, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
-    CHECK_MPI_RET(MPI_Send(&file_name_size, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
-    CHECK_MPI_RET(MPI_Send(file_name.c_str(), file_name_size, MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
+/* Requests a file's swarm from the tracker, along with the swarm version we
+ * last saw; a subscribed client gets the swarm's changes pushed afterwards */
+void Peer::req_file_swarm_from_tracker(file_download &download, bool subscribe) {
+    msg_header header = make_header(SWARM_REQUEST, download.file_id, download.swarm_version,
+                                    subscribe ? SUBSCRIBE : 0);
+    vector<char> buf;
+    pack(buf, &header);
+    send_message(buf, file_trackers[download.file_id], tracker_tag_of(download.file_id));
 }
 
-/* Sends the initial file hashes to the tracker
- * The client will act as a SEED for these files */
+/* Sends the initial file hashes to the trackers, every tracker gets
+ * the files the ring maps to it (possibly none)
+ * The client will act as a SEED for these files:
+ * [header(count = files)] followed, for every file, by
+ * [file_entry][segment_hash x segment_count][int digest_count]
+ * [uint64_t digest x digest_count]
+ * The payloads' digests are only sent when real data moves */
 void Peer::send_owned_files_to_tracker() {
-    string buffer = to_string(owned_files.size()) + " ";
-    for (auto &[file_name, hashes] : owned_files) {
-        buffer += file_name + " " + to_string(hashes.size()) + " ";
-        for (auto &hash : hashes) {
-            buffer += hash + " ";
+    vector<vector<char>> files_of_tracker(tracker_count);
+    vector<int> file_counts(tracker_count, 0);
+    for (auto &[file_name, hashes] : seed_files) {
+        file_entry entry = make_file_entry(file_name, hashes.size());
+        int tracker = ring.owner(entry.name);
+        pack(files_of_tracker[tracker], &entry);
+        pack(files_of_tracker[tracker], hashes.data(), hashes.size());
+        vector<uint64_t> digests = payload_digests(hashes);
+        int digest_count = digests.size();
+        pack(files_of_tracker[tracker], &digest_count);
+        pack(files_of_tracker[tracker], digests.data(), digest_count);
+        file_counts[tracker]++;
+    }
+
+    vector<vector<char>> parts(tracker_count);
+    for (int tracker = 0; tracker < tracker_count; tracker++) {
+        msg_header header = make_header(INITIAL_FILES, -1, file_counts[tracker]);
+        pack(parts[tracker], &header);
+        parts[tracker].insert(parts[tracker].end(), files_of_tracker[tracker].begin(), files_of_tracker[tracker].end());
+    }
+    /* The manifests are gathered by the trackers in a single collective each */
+    vector<int> sizes, displacements;
+    gather_to_trackers(parts, tracker_count, sizes, displacements);
+}
+
+/* Opens (truncating) the file's output and lays it out: the segments'
+ * hashes in the tracker's order, one per line, so every line's offset is
+ * known before any segment is acquired */
+void Peer::open_file_output(file_download &download) {
+    string path = "client" + to_string(rank) + "_" + download.file_name;
+    download.output_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (download.output_fd < 0) {
+        cerr << "[Peer " << rank << "]: Could not open " << path << endl;
+        exit(-1);
+    }
+
+    const vector<segment_hash> &hashes = owned_files[download.file_id].hashes;
+    download.line_offsets.resize(hashes.size());
+    off_t offset = 0;
+    for (int seg_idx = 0; seg_idx < (int)hashes.size(); seg_idx++) {
+        download.line_offsets[seg_idx] = offset;
+        offset += strnlen(hashes[seg_idx].bytes, HASH_SIZE) + 1;
+    }
+}
+
+/* Queues an acquired segment's line, the last line has no newline */
+void Peer::queue_segment_write(file_download &download, int seg_idx) {
+    const segment_hash &hash = owned_files[download.file_id].hashes[seg_idx];
+    write_job job;
+    job.fd = download.output_fd;
+    job.file_id = download.file_id;
+    job.offset = download.line_offsets[seg_idx];
+    job.len = strnlen(hash.bytes, HASH_SIZE);
+    memcpy(job.line, hash.bytes, job.len);
+    if (seg_idx + 1 < (int)download.line_offsets.size()) {
+        job.line[job.len++] = '\n';
+    }
+    {
+        lock_guard<mutex> lock(write_mtx);
+        write_jobs.push_back(job);
+    }
+    write_jobs_cv.notify_one();
+}
+
+void Peer::close_file_output(file_download &download) {
+    write_job job;
+    job.fd = download.output_fd;
+    job.file_id = download.file_id;
+    job.offset = 0;
+    job.len = -1;
+    {
+        lock_guard<mutex> lock(write_mtx);
+        write_jobs.push_back(job);
+    }
+    write_jobs_cv.notify_one();
+}
+
+/* The writer thread's function, writes the queued lines in batches
+ * until the download thread is done */
+void Peer::writer_thread_func() {
+    trace_thread_name("writer");
+    while (1) {
+        vector<write_job> batch;
+        {
+            unique_lock<mutex> lock(write_mtx);
+            write_jobs_cv.wait(lock, [this] { return write_done || !write_jobs.empty(); });
+            if (write_jobs.empty()) {
+                break;
+            }
+            batch.assign(write_jobs.begin(), write_jobs.end());
+            write_jobs.clear();
+        }
+        write_batch(batch);
+    }
+}
+
+/* Writes a batch of lines, the lines that are next to each other in the
+ * same output are merged into a single pwrite
+ * An output's closing is always queued after all of its lines, so the
+ * outputs are closed once all the lines of the batch were written */
+void Peer::write_batch(vector<write_job> &batch) {
+    auto closings = stable_partition(batch.begin(), batch.end(),
+                                     [](const write_job &job) { return job.len >= 0; });
+    sort(batch.begin(), closings, [](const write_job &a, const write_job &b) {
+        return a.fd != b.fd ? a.fd < b.fd : a.offset < b.offset;
+    });
+
+    vector<char> run;
+    for (auto it = batch.begin(); it != closings; ++it) {
+        run.insert(run.end(), it->line, it->line + it->len);
+        auto next = it + 1;
+        if (next != closings && next->fd == it->fd && next->offset == it->offset + it->len) {
+            continue;
+        }
+        off_t start = it->offset + it->len - run.size();
+        if (pwrite(it->fd, run.data(), run.size(), start) != (ssize_t)run.size()) {
+            cerr << "[Peer " << rank << "]: Could not write the output of file "
+                 << file_names[it->file_id] << endl;
         }
+        run.clear();
     }
 
-    int size = (int)buffer.size();
-    CHECK_MPI_RET(MPI_Send(&size, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
-    CHECK_MPI_RET(MPI_Send(buffer.c_str(), buffer.size(), MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD));
+    for (auto it = closings; it != batch.end(); ++it) {
+        close(it->fd);
+        /* Some segments couldn't be downloaded, leave no holes behind */
+        file_segments &segments = owned_files[it->file_id];
+        for (int seg_idx = 0; seg_idx < segments.segment_count; seg_idx++) {
+            if (!segments.owns(seg_idx)) {
+                save_file(it->file_id);
+                break;
+            }
+        }
+    }
 }
 
-/* Save all the downloaded files' segment hashes in a file
- * A client downloads all of a file's segments in the order 
- * given by the Tracker se there is no need reassembling them
- * before writing to disk */
-void Peer::save_file(string wanted_file_name) {
-    ofstream fout("client" + to_string(rank)+ "_" + wanted_file_name, ios::app);
-    auto &v = owned_files[wanted_file_name];
-    for (int i = 0; i < (int)v.size(); i++) {
-        fout << v[i];
-        if (i != (int)v.size() - 1) {
+/* Writes the owned segments' hashes with no gaps, only used for the files
+ * that couldn't be fully downloaded
+ * The owned segments are kept in the order given by the Tracker,
+ * so there is no need reassembling them before writing to disk */
+void Peer::save_file(int file_id) {
+    ofstream fout("client" + to_string(rank)+ "_" + file_names[file_id]);
+    file_segments &segments = owned_files[file_id];
+    bool first = true;
+    for (int i = 0; i < segments.segment_count; i++) {
+        if (!segments.owns(i)) {
+            continue;
+        }
+        if (!first) {
             fout << "\n";
         }
+        fout.write(segments.hashes[i].bytes, strnlen(segments.hashes[i].bytes, HASH_SIZE));
+        first = false;
     }
     fout.close();
 }
@@ -1,43 +1,276 @@
 #pragma once
 
 #include "utils.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "trace.h"
+#include "segments.h"
+#include "digest.h"
 
 using namespace std;
 
+/* A segment request that was sent to an owner and is still
+ * waiting for its ACK / NACK, or for the payload that follows the ACK */
+typedef struct {
+	int download_idx;
+	int seg_idx;
+	int owner;
+	int response;
+	bool receiving_payload;
+	/* This request's ACK was the first one for its segment, the others are ignored */
+	bool claimed;
+	double send_time;
+	segment_request_msg msg;
+	MPI_Request send_req;
+} segment_request;
+
+/* A wanted file being downloaded, with the segments still to be requested
+ * and how many of its requests are in flight */
+typedef struct {
+	int file_id;
+	string file_name;
+	vector<int> owners;
+	/* The last swarm version received, the tracker only sends what changed since;
+	 * the swarm is re-requested when a segment runs out of owners to ask, at most
+	 * once until the tracker pushes another change */
+	int swarm_version;
+	bool swarm_refreshed;
+	vector<int> availability;
+	/* The digests of the segments' payloads, from the tracker */
+	vector<uint64_t> digests;
+	/* The owners that have every segment, and the segments the other owners
+	 * gossiped they have, by rank; an owner that didn't gossip yet may have any */
+	vector<int> seeds;
+	unordered_map<int, vector<uint64_t>> owner_bits;
+	/* The owners that got our whole bitfield, they only get HAVEs from then on,
+	 * and the segments acquired since our last HAVE */
+	vector<int> gossip_peers;
+	vector<int> unannounced;
+	/* The attempt count of every segment, bounds how many times it's requested */
+	vector<int> attempts;
+	/* The owners that NACKed a segment in its current round of attempts */
+	unordered_map<int, vector<int>> nacked_by;
+	/* The segments an owner ACKed, once they're in the endgame's duplicate
+	 * answers are ignored */
+	vector<bool> received;
+	deque<int> pending_segments;
+	int in_flight;
+	/* Received payloads that are still being verified */
+	int verifying;
+	/* The output the segments' lines are written to as they're acquired,
+	 * every line has a fixed offset as all the hashes are known upfront */
+	int output_fd;
+	vector<off_t> line_offsets;
+} file_download;
+
+/* A segment's line for the writer thread to write at its offset in the
+ * file's output, or (len = -1) the output's closing, queued after all
+ * of its lines */
+typedef struct {
+	int fd;
+	int file_id;
+	off_t offset;
+	int len;
+	char line[HASH_SIZE + 1];
+} write_job;
+
+/* What the download thread knows about how an owner answers: the moving
+ * average of its round trip time and of its NACK / BUSY rate, how many of
+ * our requests it has in flight and until when it asked us to back off */
+typedef struct {
+	double avg_rtt;
+	double nack_rate;
+	int outstanding;
+	double busy_until;
+} owner_stats;
+
+/* A received payload to be checked against its digest by a verify worker */
+typedef struct {
+	int download_idx;
+	int seg_idx;
+	int owner;
+	uint64_t expected_digest;
+	const char *payload;
+	bool valid;
+} verify_job;
+
+/* A segment request waiting to be served by an upload worker */
+typedef struct {
+	int source;
+	segment_request_msg request;
+} upload_job;
+
 class Peer {
 private:
 	int num_tasks;
 	int rank;
-	mutex owned_files_mtx;
+	/* The trackers are ranks TRACKER_RANK .. TRACKER_RANK + tracker_count - 1,
+	 * every file's requests go to the tracker the ring maps it to, the
+	 * home tracker counts and terminates this client */
+	int tracker_count;
+	int home_tracker;
+	tracker_ring ring;
+	/* The peers only */
+	MPI_Comm peer_comm;
+
+	/* The files this client seeds, as read from its input file */
+	unordered_map<string, vector<segment_hash>> seed_files;
+	/* Every file's segments and which of them we own, indexed by file id
+	 * Allocated once, before the threads start, and shared lock-free
+	 * between the download and upload threads */
+	unique_ptr<file_segments[]> owned_files;
+	/* The segment count of every file, as sent in the tracker's file table */
+	vector<int> file_segment_counts;
 
-	unordered_map<string, vector<string>> wanted_files_hashes;
-	unordered_map<string, vector<string>> owned_files;
+	/* The file table received with the tracker's ACK, every message
+	 * after the initial handshake refers to a file by its id */
+	vector<string> file_names;
+	unordered_map<string, int> file_ids;
+	/* The tracker that owns every file, indexed by file id */
+	vector<int> file_trackers;
+	/* How many shards the trackers split the files into, also sent with the ACK */
+	int tracker_shards = 1;
 
 	vector<string> wanted_files;
 	long long segment_count;
+	/* Size of a segment's payload, 0 if only the hashes move */
+	int segment_size;
+	/* How many segment requests the download thread keeps in flight */
+	int download_window;
+	/* How many wanted files are downloaded at once */
+	int concurrent_files;
+	/* From how many owners at once a segment is requested in a file's endgame */
+	int endgame_requests;
+
+	/* Download thread only state: every wanted file's download and the
+	 * request window shared by the files being downloaded */
+	vector<file_download> downloads;
+	unordered_map<int, int> download_of_file;
+	vector<segment_request> request_slots;
+	vector<MPI_Request> response_reqs;
+	vector<int> free_slots;
+	int next_download_turn = 0;
+	/* Where every slot receives the payload of an ignored endgame answer */
+	vector<vector<char>> discard_bufs;
+	/* The HAVEs in flight, sent synchronous so a completed one was received */
+	vector<MPI_Request> gossip_reqs;
+	vector<vector<char>> gossip_bufs;
+	/* Indexed by the owner's rank */
+	vector<owner_stats> owners_stats;
+
+	/* The upload thread receives the segment requests and queues them
+	 * for the upload_worker_count workers, which serve them concurrently */
+	int upload_worker_count;
+	/* Requests received while this many are queued are answered with BUSY */
+	int upload_queue_limit;
+	deque<upload_job> upload_jobs;
+	mutex upload_jobs_mtx;
+	condition_variable upload_jobs_cv;
+	bool upload_done = false;
+	atomic<long long> served_requests{0};
+	atomic<double> first_served_time{0};
+	atomic<double> last_served_time{0};
+
+	/* The download thread hands the received payloads to verify_worker_count
+	 * workers, which hash them and hand them back, so hashing never holds up
+	 * the download thread's MPI progress */
+	int verify_worker_count;
+	deque<verify_job> verify_jobs;
+	deque<verify_job> verified_jobs;
+	mutex verify_mtx;
+	condition_variable verify_jobs_cv;
+	condition_variable verified_jobs_cv;
+	bool verify_done = false;
+	/* Payloads handed to the workers and not handed back yet, download thread only */
+	int verifying = 0;
+
+	/* The writer thread writes the acquired segments' lines as the download
+	 * thread queues them, so nothing is kept in memory until a file is done */
+	deque<write_job> write_jobs;
+	mutex write_mtx;
+	condition_variable write_jobs_cv;
+	bool write_done = false;
+
+	/* Breaks ties between equally rare segments, so the peers
+	 * don't all go for the same segments */
+	mt19937 rng;
 
 
 	/* File handling */
-	void save_file(string wanted_file_name);
+	void save_file(int file_id);
+	void open_file_output(file_download &download);
+	void queue_segment_write(file_download &download, int seg_idx);
+	void close_file_output(file_download &download);
+	void write_batch(vector<write_job> &batch);
+	void writer_thread_func();
 	void parse_initial_files();
+	void init_owned_files();
 
 	/* MPI Communication */
 	void wait_for_initial_ack();
-	void send_peer_update_to_tracker(string file_name);
-	void send_download_completed_to_tracker(string file_name);
+	void send_peer_update_to_tracker(int file_id);
+	void send_download_completed_to_tracker(int file_id);
 	void send_all_downloads_completed_to_tracker();
 	void send_owned_files_to_tracker();
-	void req_file_swarm_from_tracker(string file_name);
-	vector<int> recv_file_swarm_from_tracker(string file_name);
-	int check_if_segment_is_owned(string file_name, string segment_hash);
+	void req_file_swarm_from_tracker(file_download &download, bool subscribe = false);
+	void recv_file_swarm_from_tracker(file_download &download);
+	void refresh_swarm(file_download &download);
+	void apply_swarm_changes(file_download &download, const vector<swarm_change> &changes, int version);
+	void apply_swarm_notifications();
+	void learn_owner_segment(file_download &download, int owner, int seg_idx);
+	void apply_peer_haves();
+	void announce_segments(file_download &download);
+	void send_gossip(vector<char> &&buf, int dest);
+	void finish_gossip();
+	void send_header_to_tracker(int type, int file_id = -1);
+	int tracker_tag_of(int file_id);
+	int check_if_segment_is_owned(int file_id, const segment_hash &hash, int *seg_idx);
+	void map_file_payload(int file_id, const string &path);
+	vector<uint64_t> payload_digests(const vector<segment_hash> &hashes);
+	void send_segment_request(segment_request &req, int file_id, const segment_hash &hash,
+							  int slot, MPI_Request *response_req);
+
+	/* Orders the segments so the ones with the fewest owners come first */
+	void sort_rarest_first(deque<int> &segments, const vector<int> &availability);
 
 	/* Thread-related funcs */
 	void start_and_join_threads();
 	void download_thread_func();
+	bool start_file_download(int download_idx);
+	int pick_segment_owner(file_download &download, int seg_idx);
+	int fastest_segment_owner(file_download &download, int seg_idx, bool trust_gossip);
+	bool may_own(file_download &download, int owner, int seg_idx);
+	double expected_response_time(int owner, double now);
+	void update_owner_stats(segment_request &req);
+	bool request_next_segment(int download_idx);
+	bool request_endgame_segment(int download_idx);
+	void send_request_on_free_slot(int download_idx, int seg_idx, int owner);
+	bool segment_in_flight(int download_idx, int seg_idx);
+	void requeue_segment(file_download &download, int download_idx, int seg_idx);
+	bool download_settled(int download_idx);
+	void fill_download_window(vector<int> &active_downloads);
+	void handle_segment_response(int slot);
+	void wait_for_download_progress();
+	void segment_acquired(file_download &download, int seg_idx, int owner);
+	void queue_verification(segment_request &req);
+	void process_verified_segments();
+	void verify_worker_func();
+	void finish_file_download(file_download &download);
 	void upload_thread_func();
+	void upload_worker_func();
 
 public:
-	Peer(int numtasks, int rank) : num_tasks(numtasks), rank(rank), segment_count(0) {}
+	Peer(int numtasks, int rank, int tracker_count, MPI_Comm peer_comm) : num_tasks(numtasks), rank(rank),
+		tracker_count(tracker_count), home_tracker(TRACKER_RANK + rank % tracker_count),
+		ring(tracker_count), peer_comm(peer_comm), segment_count(0),
+		segment_size(get_config_value("SEGMENT_SIZE", DEFAULT_SEGMENT_SIZE)),
+		download_window(get_config_value("DOWNLOAD_WINDOW", DEFAULT_DOWNLOAD_WINDOW)),
+		concurrent_files(get_config_value("CONCURRENT_FILES", DEFAULT_CONCURRENT_FILES)),
+		endgame_requests(get_config_value("ENDGAME_REQUESTS", DEFAULT_ENDGAME_REQUESTS)),
+		upload_worker_count(get_config_value("UPLOAD_WORKERS", DEFAULT_UPLOAD_WORKERS)),
+		upload_queue_limit(get_config_value("UPLOAD_QUEUE_LIMIT", DEFAULT_UPLOAD_QUEUE_LIMIT)),
+		verify_worker_count(get_config_value("VERIFY_WORKERS", DEFAULT_VERIFY_WORKERS)),
+		rng(rank) {}
 
 	void init();
 };
@@ -0,0 +1,220 @@
+#include "protocol.h"
+
+using namespace std;
+
+MPI_Datatype MPI_MSG_HEADER;
+MPI_Datatype MPI_SEGMENT_HASH;
+MPI_Datatype MPI_SEGMENT_REQUEST;
+
+/* Builds and commits the derived datatypes of the fixed size messages */
+void init_protocol_datatypes() {
+    CHECK_MPI_RET(MPI_Type_contiguous(4, MPI_INT, &MPI_MSG_HEADER));
+    CHECK_MPI_RET(MPI_Type_commit(&MPI_MSG_HEADER));
+
+    CHECK_MPI_RET(MPI_Type_contiguous(HASH_SIZE, MPI_CHAR, &MPI_SEGMENT_HASH));
+    CHECK_MPI_RET(MPI_Type_commit(&MPI_SEGMENT_HASH));
+
+    int block_lengths[2] = {1, 1};
+    MPI_Aint displacements[2] = {
+        offsetof(segment_request_msg, header),
+        offsetof(segment_request_msg, hash)
+    };
+    MPI_Datatype types[2] = {MPI_MSG_HEADER, MPI_SEGMENT_HASH};
+    MPI_Datatype request_type;
+    CHECK_MPI_RET(MPI_Type_create_struct(2, block_lengths, displacements, types, &request_type));
+    /* Resize it so arrays of requests keep the struct's padding */
+    CHECK_MPI_RET(MPI_Type_create_resized(request_type, 0, sizeof(segment_request_msg), &MPI_SEGMENT_REQUEST));
+    CHECK_MPI_RET(MPI_Type_commit(&MPI_SEGMENT_REQUEST));
+    CHECK_MPI_RET(MPI_Type_free(&request_type));
+}
+
+void free_protocol_datatypes() {
+    CHECK_MPI_RET(MPI_Type_free(&MPI_SEGMENT_REQUEST));
+    CHECK_MPI_RET(MPI_Type_free(&MPI_SEGMENT_HASH));
+    CHECK_MPI_RET(MPI_Type_free(&MPI_MSG_HEADER));
+}
+
+uint64_t fnv1a_hash(const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* FNV-1a's high bits barely change between names that only differ in their
+ * last characters (file1, file2...), so the ring positions get mixed with
+ * MurmurHash3's finalizer to spread them around the whole ring */
+static uint64_t ring_position(const void *data, size_t size) {
+    uint64_t h = fnv1a_hash(data, size);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+tracker_ring::tracker_ring(int tracker_count) {
+    for (int tracker = 0; tracker < tracker_count; tracker++) {
+        for (int node = 0; node < RING_VIRTUAL_NODES; node++) {
+            int point[2] = {tracker, node};
+            points.push_back({ring_position(point, sizeof(point)), tracker});
+        }
+    }
+    sort(points.begin(), points.end());
+}
+
+int tracker_ring::owner(const string &file_name) const {
+    uint64_t h = ring_position(file_name.data(), file_name.size());
+    auto it = lower_bound(points.begin(), points.end(), make_pair(h, 0));
+    if (it == points.end()) {
+        it = points.begin();
+    }
+    return it->second;
+}
+
+segment_hash make_segment_hash(const string &hash) {
+    return make_segment_hash(hash.c_str(), hash.size());
+}
+
+segment_hash make_segment_hash(const char *hash, size_t len) {
+    segment_hash result;
+    memset(result.bytes, 0, HASH_SIZE);
+    memcpy(result.bytes, hash, min(len, (size_t)HASH_SIZE));
+    return result;
+}
+
+string segment_hash_to_string(const segment_hash &hash) {
+    return string(hash.bytes, strnlen(hash.bytes, HASH_SIZE));
+}
+
+file_entry make_file_entry(const string &file_name, int segment_count) {
+    file_entry entry;
+    memset(entry.name, 0, MAX_FILENAME);
+    memcpy(entry.name, file_name.c_str(), min(file_name.size(), (size_t)MAX_FILENAME - 1));
+    entry.segment_count = segment_count;
+    return entry;
+}
+
+msg_header make_header(int type, int file_id, int count, int tag) {
+    msg_header header;
+    header.type = type;
+    header.file_id = file_id;
+    header.count = count;
+    header.tag = tag;
+    return header;
+}
+
+void send_message(const vector<char> &buf, int dest, int tag) {
+    CHECK_MPI_RET(MPI_Send(buf.data(), buf.size(), MPI_BYTE, dest, tag, MPI_COMM_WORLD));
+}
+
+/* Sizes the buffer from an already matched message and receives it */
+static vector<char> recv_matched_message(MPI_Message *message, MPI_Status *probe_status, MPI_Status *status) {
+    int size;
+    CHECK_MPI_RET(MPI_Get_count(probe_status, MPI_BYTE, &size));
+    vector<char> buf(size);
+    CHECK_MPI_RET(MPI_Mrecv(buf.data(), size, MPI_BYTE, message, MPI_STATUS_IGNORE));
+
+    if (status != MPI_STATUS_IGNORE) {
+        *status = *probe_status;
+    }
+    return buf;
+}
+
+/* Matches a message with MPI_Mprobe, so it can't be stolen by another
+ * thread receiving on the same source / tag, then sizes the buffer
+ * from it and receives it with MPI_Mrecv */
+vector<char> recv_message(int source, int tag, MPI_Status *status) {
+    MPI_Message message;
+    MPI_Status probe_status;
+    CHECK_MPI_RET(MPI_Mprobe(source, tag, MPI_COMM_WORLD, &message, &probe_status));
+    return recv_matched_message(&message, &probe_status, status);
+}
+
+/* Gathers on every tracker t the parts[t] of all the ranks, the gathers of
+ * all the trackers are started at once so they progress together
+ * On a tracker, returns the gathered parts, rank r's part being at
+ * displacements[r] and sizes[r] long; elsewhere returns nothing */
+vector<char> gather_to_trackers(const vector<vector<char>> &parts, int tracker_count,
+                                vector<int> &sizes, vector<int> &displacements) {
+    int rank, numtasks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+    bool is_tracker = rank >= TRACKER_RANK && rank < TRACKER_RANK + tracker_count;
+    if (is_tracker) {
+        sizes.assign(numtasks, 0);
+        displacements.assign(numtasks, 0);
+    }
+
+    vector<int> part_sizes(tracker_count);
+    vector<MPI_Request> reqs(tracker_count);
+    for (int t = 0; t < tracker_count; t++) {
+        part_sizes[t] = parts[t].size();
+        CHECK_MPI_RET(MPI_Igather(&part_sizes[t], 1, MPI_INT, sizes.data(), 1, MPI_INT,
+                                  TRACKER_RANK + t, MPI_COMM_WORLD, &reqs[t]));
+    }
+    CHECK_MPI_RET(MPI_Waitall(tracker_count, reqs.data(), MPI_STATUSES_IGNORE));
+
+    vector<char> gathered;
+    if (is_tracker) {
+        for (int r = 1; r < numtasks; r++) {
+            displacements[r] = displacements[r - 1] + sizes[r - 1];
+        }
+        gathered.resize(displacements[numtasks - 1] + sizes[numtasks - 1]);
+    }
+    for (int t = 0; t < tracker_count; t++) {
+        CHECK_MPI_RET(MPI_Igatherv(parts[t].data(), part_sizes[t], MPI_BYTE, gathered.data(), sizes.data(),
+                                   displacements.data(), MPI_BYTE, TRACKER_RANK + t, MPI_COMM_WORLD, &reqs[t]));
+    }
+    CHECK_MPI_RET(MPI_Waitall(tracker_count, reqs.data(), MPI_STATUSES_IGNORE));
+    return gathered;
+}
+
+/* Broadcasts the root's buffer, its size first so the others can size theirs */
+void broadcast_message(vector<char> &buf, int root) {
+    int size = buf.size();
+    CHECK_MPI_RET(MPI_Bcast(&size, 1, MPI_INT, root, MPI_COMM_WORLD));
+    buf.resize(size);
+    CHECK_MPI_RET(MPI_Bcast(buf.data(), size, MPI_BYTE, root, MPI_COMM_WORLD));
+}
+
+bool try_recv_message(int source, int tag, vector<char> &buf, MPI_Status *status) {
+    int flag;
+    MPI_Message message;
+    MPI_Status probe_status;
+    CHECK_MPI_RET(MPI_Improbe(source, tag, MPI_COMM_WORLD, &flag, &message, &probe_status));
+    if (!flag) {
+        return false;
+    }
+    buf = recv_matched_message(&message, &probe_status, status);
+    return true;
+}
+
+void drop_completed_sends(vector<MPI_Request> &reqs, vector<vector<char>> &bufs) {
+    if (reqs.empty()) {
+        return;
+    }
+    int done_count;
+    vector<int> done(reqs.size());
+    CHECK_MPI_RET(MPI_Testsome(reqs.size(), reqs.data(), &done_count, done.data(), MPI_STATUSES_IGNORE));
+
+    /* The completed requests were set to MPI_REQUEST_NULL; a buffer is never
+     * moved onto itself, that would free the storage a pending send reads */
+    int kept = 0;
+    for (int i = 0; i < (int)reqs.size(); i++) {
+        if (reqs[i] == MPI_REQUEST_NULL) {
+            continue;
+        }
+        if (kept != i) {
+            reqs[kept] = reqs[i];
+            bufs[kept] = move(bufs[i]);
+        }
+        kept++;
+    }
+    reqs.resize(kept);
+    bufs.resize(kept);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <string.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+using namespace std;
+
+/* Segment hashes and file names have a fixed width on the wire */
+#define HASH_SIZE 32
+#define MAX_FILENAME 32
+
+/* A segment hash kept as raw bytes, it's NOT null terminated
+ * if the hash takes the whole HASH_SIZE */
+struct segment_hash {
+    char bytes[HASH_SIZE];
+
+    bool operator==(const segment_hash &other) const {
+        return memcmp(bytes, other.bytes, HASH_SIZE) == 0;
+    }
+};
+
+/* Fixed header that starts every message between the peers and the tracker
+ * type    - one of the Constants message types
+ * file_id - the file's id as assigned by the tracker, -1 if not used
+ * count   - number of entries following the header (owners, files etc.)
+ * tag     - the tag on which the answer is expected, if any */
+typedef struct {
+    int type;
+    int file_id;
+    int count;
+    int tag;
+} msg_header;
+
+/* A peer's request for a segment, also used by the tracker
+ * to send TERMINATE to the upload threads */
+typedef struct {
+    msg_header header;
+    segment_hash hash;
+} segment_request_msg;
+
+/* An owner that joined (added = 1) or left (added = 0) a swarm, or that
+ * owns every segment of the file (added = SWARM_SEED) */
+typedef struct {
+    int rank;
+    int added;
+} swarm_change;
+
+/* An entry of a file table / manifest */
+typedef struct {
+    char name[MAX_FILENAME];
+    int segment_count;
+} file_entry;
+
+/* Maps the files to the trackers that own them by consistent hashing of
+ * the file's name, every tracker gets RING_VIRTUAL_NODES points on the ring
+ * and a file belongs to the first point at or after its name's hash
+ * The peers and the trackers build the same ring, so they agree on the
+ * owners without exchanging anything */
+struct tracker_ring {
+    vector<pair<uint64_t, int>> points;
+
+    tracker_ring(int tracker_count);
+    int owner(const string &file_name) const;
+};
+
+/* Derived datatypes for the fixed size messages, built by
+ * init_protocol_datatypes() right after MPI is initialized */
+extern MPI_Datatype MPI_MSG_HEADER;
+extern MPI_Datatype MPI_SEGMENT_HASH;
+extern MPI_Datatype MPI_SEGMENT_REQUEST;
+
+void init_protocol_datatypes();
+void free_protocol_datatypes();
+
+/* 64 bit FNV-1a */
+uint64_t fnv1a_hash(const void *data, size_t size);
+
+segment_hash make_segment_hash(const string &hash);
+segment_hash make_segment_hash(const char *hash, size_t len);
+string segment_hash_to_string(const segment_hash &hash);
+file_entry make_file_entry(const string &file_name, int segment_count);
+msg_header make_header(int type, int file_id = -1, int count = 0, int tag = 0);
+
+/* Sends / receives a whole variable sized message at once, the receiver
+ * sizes its buffer from the matched message */
+void send_message(const vector<char> &buf, int dest, int tag);
+vector<char> recv_message(int source, int tag, MPI_Status *status = MPI_STATUS_IGNORE);
+/* Same as recv_message, but returns false right away if no message is pending */
+bool try_recv_message(int source, int tag, vector<char> &buf, MPI_Status *status = MPI_STATUS_IGNORE);
+
+/* Tests nonblocking sends and drops the completed ones along with
+ * their buffers, the pending ones keep their buffers' storage */
+void drop_completed_sends(vector<MPI_Request> &reqs, vector<vector<char>> &bufs);
+
+/* Collectives of the initial handshake, every rank must take part */
+vector<char> gather_to_trackers(const vector<vector<char>> &parts, int tracker_count,
+                                vector<int> &sizes, vector<int> &displacements);
+void broadcast_message(vector<char> &buf, int root);
+
+/* Appends count raw elements to a message buffer */
+template <typename T>
+static inline void pack(vector<char> &buf, const T *data, size_t count = 1) {
+    const char *bytes = reinterpret_cast<const char *>(data);
+    buf.insert(buf.end(), bytes, bytes + count * sizeof(T));
+}
+
+/* Reads count raw elements from a message buffer and advances the cursor */
+template <typename T>
+static inline void unpack(const char *&cursor, T *data, size_t count = 1) {
+    memcpy(data, cursor, count * sizeof(T));
+    cursor += count * sizeof(T);
+}
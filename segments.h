@@ -0,0 +1,149 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "protocol.h"
+
+using namespace std;
+
+/* Hashes a segment hash's raw bytes (FNV-1a), so segment hashes
+ * can be used as unordered_map keys */
+struct segment_hash_hasher {
+    size_t operator()(const segment_hash &hash) const {
+        return fnv1a_hash(hash.bytes, HASH_SIZE);
+    }
+};
+
+/* The input files only carry the segments' hashes, so a seed's payload
+ * is made up by repeating the segment's hash */
+static inline void make_segment_payload(char *dest, const segment_hash &hash, int segment_size) {
+    for (int i = 0; i < segment_size; i++) {
+        dest[i] = hash.bytes[i % HASH_SIZE];
+    }
+}
+
+/* A file's segments in the tracker's order and the ones this client owns
+ * The ownership bitfield is preallocated from the file table's segment count
+ * and only ever gets bits set with atomic ORs, so the upload threads can test
+ * bits without any lock while the download thread publishes new segments
+ * The hashes and the hash -> index map are built once, when the hashes are
+ * first received, then published with hashes_ready; they're never modified
+ * afterwards, so readers that saw hashes_ready can use them lock-free
+ * When real data moves, every segment's payload has a fixed place in a
+ * mapped region; the received segments are written there directly and
+ * an owned segment's payload is sent straight from there */
+struct file_segments {
+    int segment_count = 0;
+    vector<segment_hash> hashes;
+    unordered_map<segment_hash, int, segment_hash_hasher> index;
+    unique_ptr<atomic<uint64_t>[]> bitfield;
+    atomic<bool> hashes_ready{false};
+    char *payload = NULL;
+    size_t payload_size = 0;
+    int segment_size = 0;
+
+    ~file_segments() {
+        if (payload != NULL) {
+            munmap(payload, payload_size);
+        }
+    }
+
+    /* Must be called before the upload / download threads start */
+    void init(int file_segment_count) {
+        segment_count = file_segment_count;
+        int words = (segment_count + 63) / 64;
+        bitfield.reset(new atomic<uint64_t>[words]);
+        for (int word = 0; word < words; word++) {
+            bitfield[word].store(0, memory_order_relaxed);
+        }
+    }
+
+    bool has_hashes() const {
+        return hashes_ready.load(memory_order_acquire);
+    }
+
+    /* Only called once, by the thread that received the hashes */
+    void set_hashes(const vector<segment_hash> &file_hashes) {
+        hashes = file_hashes;
+        index.reserve(hashes.size());
+        for (int seg_idx = 0; seg_idx < (int)hashes.size(); seg_idx++) {
+            index.emplace(hashes[seg_idx], seg_idx);
+        }
+        hashes_ready.store(true, memory_order_release);
+    }
+
+    /* Returns the segment's index in the file, -1 if it isn't part of it
+     * or the hashes aren't known yet */
+    int index_of(const segment_hash &hash) const {
+        if (!has_hashes()) {
+            return -1;
+        }
+        auto it = index.find(hash);
+        return it == index.end() ? -1 : it->second;
+    }
+
+    bool owns(int seg_idx) const {
+        return (bitfield[seg_idx / 64].load(memory_order_acquire) >> (seg_idx % 64)) & 1;
+    }
+
+    void mark_owned(int seg_idx) {
+        bitfield[seg_idx / 64].fetch_or(1ULL << (seg_idx % 64), memory_order_release);
+    }
+
+    /* A copy of the ownership bitfield, to be reported to the tracker */
+    vector<uint64_t> snapshot_bitfield() const {
+        vector<uint64_t> words((segment_count + 63) / 64);
+        for (int word = 0; word < (int)words.size(); word++) {
+            words[word] = bitfield[word].load(memory_order_acquire);
+        }
+        return words;
+    }
+
+    void mark_all_owned() {
+        for (int seg_idx = 0; seg_idx < segment_count; seg_idx++) {
+            mark_owned(seg_idx);
+        }
+    }
+
+    /* Maps the payload region, backed by the file at path so the segments
+     * end up in their final place on disk, or anonymous if path is empty
+     * Must be done before any of the file's segments is marked as owned */
+    bool map_payload(const string &path, int size) {
+        segment_size = size;
+        payload_size = (size_t)segment_count * segment_size;
+        if (payload_size == 0) {
+            return true;
+        }
+
+        int fd = -1;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (!path.empty()) {
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || ftruncate(fd, payload_size) != 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return false;
+            }
+            flags = MAP_SHARED;
+        }
+        void *region = mmap(NULL, payload_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (region == MAP_FAILED) {
+            return false;
+        }
+        payload = (char *)region;
+        return true;
+    }
+
+    char *segment_payload(int seg_idx) {
+        return payload + (size_t)seg_idx * segment_size;
+    }
+};
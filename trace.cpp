@@ -0,0 +1,136 @@
+#include <memory>
+
+#include "trace.h"
+
+using namespace std;
+
+bool trace_enabled = false;
+
+/* A thread's spans, kept in a ring: past its capacity the newest
+ * span overwrites the oldest one */
+typedef struct {
+    string name;
+    vector<trace_event> events;
+    uint64_t recorded;
+} trace_buffer;
+
+static mutex registry_mtx;
+static vector<unique_ptr<trace_buffer>> registry;
+static string trace_role;
+static double trace_origin;
+static int buffer_capacity;
+
+static trace_buffer &thread_trace_buffer() {
+    thread_local trace_buffer *buffer = NULL;
+    if (buffer == NULL) {
+        unique_ptr<trace_buffer> new_buffer(new trace_buffer());
+        new_buffer->name = "main";
+        new_buffer->events.resize(buffer_capacity);
+        new_buffer->recorded = 0;
+        buffer = new_buffer.get();
+        lock_guard<mutex> lock(registry_mtx);
+        registry.push_back(move(new_buffer));
+    }
+    return *buffer;
+}
+
+void trace_init(const char *role) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    /* Only the rank writing the trace has to see TRACE_FILE */
+    int enabled = 0;
+    if (rank == TRACKER_RANK) {
+        enabled = getenv("TRACE_FILE") != NULL;
+    }
+    CHECK_MPI_RET(MPI_Bcast(&enabled, 1, MPI_INT, TRACKER_RANK, MPI_COMM_WORLD));
+    trace_enabled = enabled;
+    trace_role = role;
+    buffer_capacity = get_config_value("TRACE_BUFFER_EVENTS", DEFAULT_TRACE_BUFFER_EVENTS);
+
+    /* MPI_Wtime isn't necessarily synchronized across the nodes, every
+     * rank measures its spans from the moment it left the barrier */
+    CHECK_MPI_RET(MPI_Barrier(MPI_COMM_WORLD));
+    trace_origin = MPI_Wtime();
+}
+
+void trace_thread_name(const char *name) {
+    if (trace_enabled) {
+        thread_trace_buffer().name = name;
+    }
+}
+
+void trace_record(const char *name, double start, double end, int file_id, int peer) {
+    if (!trace_enabled) {
+        return;
+    }
+    trace_buffer &buffer = thread_trace_buffer();
+    buffer.events[buffer.recorded % buffer.events.size()] = {name, start, end, file_id, peer};
+    buffer.recorded++;
+}
+
+/* This rank's part of the trace, every event followed by a comma */
+static string format_rank_trace(int rank) {
+    ostringstream out;
+    out << fixed;
+    out.precision(3);
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << rank
+        << ", \"args\": {\"name\": \"" << trace_role << " " << rank << "\"}},\n";
+
+    for (size_t tid = 0; tid < registry.size(); tid++) {
+        trace_buffer &buffer = *registry[tid];
+        out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << rank << ", \"tid\": " << tid
+            << ", \"args\": {\"name\": \"" << buffer.name << "\"}},\n";
+
+        uint64_t capacity = buffer.events.size();
+        uint64_t first = buffer.recorded > capacity ? buffer.recorded - capacity : 0;
+        if (first > 0) {
+            cerr << "[TRACE " << rank << "]: thread " << buffer.name << " dropped its "
+                 << first << " oldest spans" << endl;
+        }
+        for (uint64_t i = first; i < buffer.recorded; i++) {
+            const trace_event &event = buffer.events[i % capacity];
+            out << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": " << rank
+                << ", \"tid\": " << tid
+                << ", \"ts\": " << (event.start - trace_origin) * 1e6
+                << ", \"dur\": " << (event.end - event.start) * 1e6
+                << ", \"args\": {\"file\": " << event.file_id << ", \"peer\": " << event.peer << "}},\n";
+        }
+    }
+    return out.str();
+}
+
+void export_trace() {
+    if (!trace_enabled) {
+        return;
+    }
+    int rank, numtasks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+
+    string part = format_rank_trace(rank);
+    int part_size = part.size();
+    vector<int> sizes(numtasks), displacements(numtasks);
+    CHECK_MPI_RET(MPI_Gather(&part_size, 1, MPI_INT, sizes.data(), 1, MPI_INT, TRACKER_RANK, MPI_COMM_WORLD));
+
+    vector<char> merged;
+    if (rank == TRACKER_RANK) {
+        int total = 0;
+        for (int r = 0; r < numtasks; r++) {
+            displacements[r] = total;
+            total += sizes[r];
+        }
+        merged.resize(total);
+    }
+    CHECK_MPI_RET(MPI_Gatherv(part.data(), part_size, MPI_CHAR, merged.data(), sizes.data(),
+                              displacements.data(), MPI_CHAR, TRACKER_RANK, MPI_COMM_WORLD));
+
+    if (rank == TRACKER_RANK) {
+        /* Drop the last event's trailing comma */
+        size_t length = merged.size() >= 2 ? merged.size() - 2 : 0;
+        ofstream out(getenv("TRACE_FILE"));
+        out << "{\"traceEvents\": [\n";
+        out.write(merged.data(), length);
+        out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    }
+}
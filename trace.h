@@ -0,0 +1,59 @@
+#pragma once
+
+#include "utils.h"
+
+using namespace std;
+
+/* Optional timeline of the hot paths, enabled by setting TRACE_FILE
+ * Every thread records its spans into its own ring buffer, without locks;
+ * at shutdown the buffers of all the ranks are merged on TRACKER_RANK
+ * into a single Chrome trace (JSON), which Perfetto / chrome://tracing open
+ * The spans are timed with MPI_Wtime, relative to a barrier every rank
+ * leaves at about the same time */
+
+typedef struct {
+    /* Points to a string literal, only the pointer is kept */
+    const char *name;
+    double start;
+    double end;
+    int file_id;
+    int peer;
+} trace_event;
+
+/* Reads TRACE_FILE and aligns the ranks' clocks
+ * Collective, role names the rank's process in the timeline */
+void trace_init(const char *role);
+
+/* Set once by trace_init, before any thread is started */
+extern bool trace_enabled;
+
+/* Names the calling thread in the timeline */
+void trace_thread_name(const char *name);
+
+/* Records a span of the calling thread, start and end come from MPI_Wtime */
+void trace_record(const char *name, double start, double end, int file_id = -1, int peer = -1);
+
+static inline double trace_now() {
+    return trace_enabled ? MPI_Wtime() : 0;
+}
+
+/* Records the span of the enclosing scope */
+struct trace_scope {
+    const char *name;
+    double start;
+    int file_id;
+    int peer;
+
+    trace_scope(const char *name, int file_id = -1, int peer = -1)
+        : name(name), start(trace_now()), file_id(file_id), peer(peer) {}
+
+    ~trace_scope() {
+        if (trace_enabled) {
+            trace_record(name, start, MPI_Wtime(), file_id, peer);
+        }
+    }
+};
+
+/* Gathers every rank's spans on TRACKER_RANK, which writes them to TRACE_FILE
+ * Collective, every rank must call it after its threads were joined */
+void export_trace();
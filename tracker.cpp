@@ -2,11 +2,47 @@
 
 using namespace std;
 
+/* Helpers for the sorted rank lists of the file control blocks */
+static bool sorted_contains(const vector<int> &ranks, int rank) {
+    return binary_search(ranks.begin(), ranks.end(), rank);
+}
+
+/* Returns false if the rank was already present */
+static bool sorted_insert(vector<int> &ranks, int rank) {
+    auto it = lower_bound(ranks.begin(), ranks.end(), rank);
+    if (it != ranks.end() && *it == rank) {
+        return false;
+    }
+    ranks.insert(it, rank);
+    return true;
+}
+
+static void sorted_erase(vector<int> &ranks, int rank) {
+    auto it = lower_bound(ranks.begin(), ranks.end(), rank);
+    if (it != ranks.end() && *it == rank) {
+        ranks.erase(it);
+    }
+}
+
+/* Returns the peer's last reported bitfield, creating an empty one if needed */
+static vector<uint64_t> &find_peer_bitfield(fcb &block, int rank) {
+    auto it = lower_bound(block.peer_bitfields.begin(), block.peer_bitfields.end(), rank,
+                          [](const peer_bitfield &entry, int r) { return entry.rank < r; });
+    if (it == block.peer_bitfields.end() || it->rank != rank) {
+        it = block.peer_bitfields.insert(it, peer_bitfield{rank, {}});
+    }
+    return it->bits;
+}
+
 /* Encapsulates the Tracker's workflow in a single function for 
  * better readability */
 void Tracker::init() {
     receive_initial_files_from_clients();
 
+    exchange_file_tables();
+
+    split_files_into_shards();
+
     acknowledge_initial_files();
 
     start_mediating_the_swarms();
@@ -14,169 +50,454 @@ void Tracker::init() {
     signal_all_seeds_to_terminate();
 }
 
+/* There's no use for more shards than files */
+void Tracker::split_files_into_shards() {
+    shard_count = max(1, min(shard_count, (int)file_control_blocks.size()));
+    shards.resize(shard_count);
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].tag = TRACKER_SHARD_TAG + i;
+    }
+}
+
+/* The files are split between the shards by id, a file's requests
+ * are received and handled only by its shard's thread */
+tracker_shard &Tracker::shard_of(int file_id) {
+    return shards[file_id % shard_count];
+}
+
+/* The coordinator: starts a worker thread for every shard, then counts
+ * the home clients that got all their files
+ * Every client signals the shards of all the trackers too, after its last
+ * request to them, so once all the clients are done the shards have nothing
+ * left to handle
+ * The trackers then sum up their counters, the job is done only once every
+ * tracker's clients are, until then a client may still be downloading from
+ * the clients of the other trackers */
 void Tracker::start_mediating_the_swarms() {
-    int client_count = num_tasks - 1;
-    while (clients_done < client_count) {
+    double start_time = MPI_Wtime();
+    vector<thread> workers;
+    for (auto &shard : shards) {
+        workers.emplace_back(&Tracker::shard_thread_func, this, ref(shard));
+    }
+
+    int home_clients = 0;
+    for (int r = TRACKER_RANK + tracker_count; r < num_tasks; r++) {
+        home_clients += is_home_client(r);
+    }
+    while (clients_done < home_clients) {
+        MPI_Status status;
+        recv_message(MPI_ANY_SOURCE, TRACKER_TAG, &status);
+        all_downloads_completed(status.MPI_SOURCE);
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    long long handled_requests = clients_done;
+    for (auto &shard : shards) {
+        handled_requests += shard.handled_requests;
+    }
+    cerr << "[TRACKER " << rank << "]: Handled " << handled_requests << " requests in "
+         << MPI_Wtime() - start_time << "s" << endl;
+
+    int all_clients_done;
+    CHECK_MPI_RET(MPI_Allreduce(&clients_done, &all_clients_done, 1, MPI_INT, MPI_SUM, tracker_comm));
+    if (all_clients_done != num_tasks - tracker_count) {
+        cerr << "[TRACKER " << rank << "]: only " << all_clients_done << " clients are done" << endl;
+    }
+    cerr << "[TRACKER " << rank << "]: DONE mediating the swarms, exiting" << endl;
+}
+
+/* A shard's event loop: blocks until a request arrives, then drains
+ * every request that is already pending before going back to sleep
+ * Replies are sent nonblocking and collected in batches, so the loop
+ * never waits for a client to receive its answer
+ * Swarm changes are pushed to the subscribers once per notify_interval */
+void Tracker::shard_thread_func(tracker_shard &shard) {
+    trace_thread_name("shard");
+    int client_count = num_tasks - tracker_count;
+    while (shard.clients_done < client_count) {
         MPI_Status status;
-		int client_rank;
-        int type;
-        CHECK_MPI_RET(MPI_Recv(&type, 1, MPI_INT, MPI_ANY_SOURCE, TRACKER_TAG, MPI_COMM_WORLD, &status));
-		client_rank = status.MPI_SOURCE;
-        switch(type) {
-            case SINGLE_FILE_DOWNLOAD_COMPLETED:
-                download_completed(client_rank);
-                break;
-            case SWARM_REQUEST:
-                swarm_req(client_rank);
-                break;
-            case CLIENT_GOT_ALL_FILES:
-                all_downloads_completed(client_rank);
-                break;
-            case PEER_UPDATE:
-                peer_update(client_rank);
-                break;
+        /* Every request is a single self-describing message */
+        vector<char> request;
+        if (wait_for_request(shard, request, &status)) {
+            dispatch_request(shard, status.MPI_SOURCE, request);
+        }
+
+        while (shard.clients_done < client_count
+               && try_recv_message(MPI_ANY_SOURCE, shard.tag, request, &status)) {
+            dispatch_request(shard, status.MPI_SOURCE, request);
         }
-        cerr << "[TRACKER]: Clients who've completed all their downloads: " << clients_done << endl;
+
+        if (!shard.notify_pending.empty() && MPI_Wtime() >= shard.next_notify_time) {
+            flush_notifications(shard);
+        }
+        flush_replies(shard, false);
     }
-    cerr << "[TRACKER]: DONE mediating the swarms, exiting" << endl;
+    flush_replies(shard, true);
+}
+
+bool Tracker::wait_for_request(tracker_shard &shard, vector<char> &request, MPI_Status *status) {
+    if (shard.notify_pending.empty()) {
+        request = recv_message(MPI_ANY_SOURCE, shard.tag, status);
+        return true;
+    }
+    while (MPI_Wtime() < shard.next_notify_time) {
+        if (try_recv_message(MPI_ANY_SOURCE, shard.tag, request, status)) {
+            return true;
+        }
+        usleep(50);
+    }
+    return false;
+}
+
+/* Pushes to every subscriber the changes of the swarm since the last push
+ * [header(SWARM_NOTIFY, count = changes, tag = version)][swarm_change x count]
+ * A client that subscribed after the last push may get some changes
+ * it already has, applying them again doesn't change its swarm */
+void Tracker::flush_notifications(tracker_shard &shard) {
+    trace_scope span("swarm notify");
+    for (auto file_id : shard.notify_pending) {
+        fcb &block = file_control_blocks[file_id];
+        int version = block.swarm_log.size();
+        int change_count = version - block.notified_version;
+
+        vector<char> notification;
+        msg_header header = make_header(SWARM_NOTIFY, file_id, change_count, version);
+        pack(notification, &header);
+        pack(notification, block.swarm_log.data() + block.notified_version, change_count);
+        /* Sent synchronously, so waiting for the replies before TERMINATE
+         * means every subscriber received its notifications */
+        for (auto subscriber : block.subscribers) {
+            queue_reply(shard, vector<char>(notification), subscriber, SWARM_NOTIFY_TAG, true);
+        }
+        count_metric(SWARM_NOTIFICATIONS, block.subscribers.size());
+        block.notified_version = version;
+        block.notify_queued = false;
+    }
+    shard.notify_pending.clear();
+}
+
+/* The name of a request's handler in the timeline */
+static const char *request_name(int type) {
+    switch(type) {
+        case SINGLE_FILE_DOWNLOAD_COMPLETED:
+            return "download completed";
+        case SWARM_REQUEST:
+            return "swarm request";
+        case CLIENT_GOT_ALL_FILES:
+            return "client done";
+        case PEER_UPDATE:
+            return "peer update";
+    }
+    return "unknown request";
+}
+
+void Tracker::dispatch_request(tracker_shard &shard, int client_rank, const vector<char> &request) {
+    const char *cursor = request.data();
+    msg_header header;
+    unpack(cursor, &header);
+    shard.handled_requests++;
+    count_metric(TRACKER_REQUESTS);
+    double handler_start = metrics_now();
+    trace_scope span(request_name(header.type), header.file_id, client_rank);
+    switch(header.type) {
+        case SINGLE_FILE_DOWNLOAD_COMPLETED:
+            download_completed(client_rank, header.file_id);
+            break;
+        case SWARM_REQUEST:
+            swarm_req(client_rank, header.file_id, header.count, header.tag == SUBSCRIBE);
+            break;
+        case CLIENT_GOT_ALL_FILES:
+            shard.clients_done++;
+            break;
+        case PEER_UPDATE: {
+            vector<uint64_t> bitfield(header.count);
+            unpack(cursor, bitfield.data(), header.count);
+            peer_update(client_rank, header.file_id, bitfield);
+            break;
+        }
+    }
+    record_latency(TRACKER_HANDLER_TIME, metrics_now() - handler_start);
+}
+
+void Tracker::queue_reply(tracker_shard &shard, vector<char> &&buf, int dest, int tag, bool synchronous) {
+    shard.reply_bufs.push_back(move(buf));
+    shard.reply_reqs.push_back(MPI_REQUEST_NULL);
+    /* Moving the buffers around doesn't move their data, so the
+     * pointer given to MPI_Isend stays valid */
+    vector<char> &reply = shard.reply_bufs.back();
+    if (synchronous) {
+        CHECK_MPI_RET(MPI_Issend(reply.data(), reply.size(), MPI_BYTE, dest, tag, MPI_COMM_WORLD, &shard.reply_reqs.back()));
+    } else {
+        CHECK_MPI_RET(MPI_Isend(reply.data(), reply.size(), MPI_BYTE, dest, tag, MPI_COMM_WORLD, &shard.reply_reqs.back()));
+    }
+}
+
+void Tracker::flush_replies(tracker_shard &shard, bool wait_all) {
+    if (wait_all && !shard.reply_reqs.empty()) {
+        CHECK_MPI_RET(MPI_Waitall(shard.reply_reqs.size(), shard.reply_reqs.data(), MPI_STATUSES_IGNORE));
+    }
+    /* Drop the delivered replies */
+    drop_completed_sends(shard.reply_reqs, shard.reply_bufs);
 }
 
 /* All downloads are complete so signal all clients 
  * to gracefully close their threads and terminate
  * their execution */
 void Tracker::signal_all_seeds_to_terminate() {
-    string terminate = "TERMINATE";
-    int size = terminate.size();
-    for (int i = 1; i < num_tasks; i++) {
-        CHECK_MPI_RET(MPI_Send(&size, 1, MPI_INT, i, UPLOAD_TAG, MPI_COMM_WORLD));
-        CHECK_MPI_RET(MPI_Send(terminate.c_str(), terminate.size(), MPI_CHAR, i, UPLOAD_TAG, MPI_COMM_WORLD));
+    segment_request_msg terminate;
+    memset(&terminate, 0, sizeof(terminate));
+    terminate.header = make_header(TERMINATE);
+    for (int i = TRACKER_RANK + tracker_count; i < num_tasks; i++) {
+        if (!is_home_client(i)) {
+            continue;
+        }
+        CHECK_MPI_RET(MPI_Send(&terminate, 1, MPI_SEGMENT_REQUEST, i, UPLOAD_TAG, MPI_COMM_WORLD));
     }
 }
 
-/* Sends the ACK to the inital seeds so they know 
- * they can start their download and upload threads */
+/* Broadcasts the ACK to the inital seeds so they know 
+ * they can start their download and upload threads
+ * The ACK carries the file table, so from now on the
+ * files can be referred to by their ids, and the number
+ * of shards, so the clients know where to send their requests
+ * Every tracker has the same table, the first one broadcasts it */
 void Tracker::acknowledge_initial_files() {
-    int ack = 1;
-    for (int i = 1; i < num_tasks; i++) {
-        CHECK_MPI_RET(MPI_Send(&ack, 1, MPI_INT, i, TRACKER_TAG, MPI_COMM_WORLD));
+    vector<char> buf;
+    if (rank == TRACKER_RANK) {
+        msg_header header = make_header(ACK, -1, file_table.size(), shard_count);
+        pack(buf, &header);
+        pack(buf, file_table.data(), file_table.size());
     }
+    broadcast_message(buf, TRACKER_RANK);
 }
 
-/* Constructs a string containing all peers / seeds of a file */
-string Tracker::get_file_swarm(string file_name) {
-    string swarm;
-    vector<int>& owners = swarms[file_name];
+/* Appends the header and the swarm changes a client hasn't seen yet
+ * A client that never got this file's swarm gets all the current owners
+ * as additions instead of the whole log */
+void Tracker::pack_file_swarm(int file_id, int known_version, vector<char> &buf) {
+    fcb &block = file_control_blocks[file_id];
+    int version = block.swarm_log.size();
 
-    /* Get all seeds / peers of this file */
-    swarm += to_string(owners.size()) + " ";
-    for (auto owner : owners) {
-        swarm += to_string(owner) + " ";
+    vector<swarm_change> changes;
+    if (known_version == 0) {
+        for (auto owner : block.swarm) {
+            changes.push_back(swarm_change{owner, sorted_contains(block.seeds, owner) ? SWARM_SEED : 1});
+        }
+    } else {
+        changes.assign(block.swarm_log.begin() + min(known_version, version), block.swarm_log.end());
     }
-    return swarm;
+
+    msg_header header = make_header(SWARM_REQUEST, file_id, changes.size(), version);
+    pack(buf, &header);
+    pack(buf, changes.data(), changes.size());
 }
 
-/* Receives a swarm_request from a client */
-void Tracker::swarm_req(int source) {
-    int size;
-    CHECK_MPI_RET(MPI_Recv(&size, 1, MPI_INT, source, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    char buf[size + 1];
-    CHECK_MPI_RET(MPI_Recv(buf, size, MPI_CHAR, source, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    buf[size] = '\0';
-    string file_name(buf);
+/* Answers a swarm_request from a client, who sent the swarm version it last saw
+ * [header(count = changes, tag = version)][swarm_change x count][int hash_count]
+ * [segment_hash x hash_count][int digest_count][uint64_t digest x digest_count]
+ * [int segment_count][int availability x segment_count]
+ * The hashes and the digests are only sent along with the client's first swarm
+ * A subscribed client gets the swarm's changes pushed from now on */
+void Tracker::swarm_req(int source, int file_id, int known_version, bool subscribe) {
+    fcb &block = file_control_blocks[file_id];
+    if (subscribe) {
+        sorted_insert(block.subscribers, source);
+    }
+
+    vector<char> swarm;
+    pack_file_swarm(file_id, known_version, swarm);
 
-    string swarm = get_file_swarm(file_name);
+    // Now add the file's hashes so the client knows what segments it needs
+    int segment_count = block.hashes.size();
+    int hash_count = known_version == 0 ? segment_count : 0;
+    pack(swarm, &hash_count);
+    pack(swarm, block.hashes.data(), hash_count);
+    int digest_count = known_version == 0 ? block.digests.size() : 0;
+    pack(swarm, &digest_count);
+    pack(swarm, block.digests.data(), digest_count);
 
-    // Now add the file's hashes so the client can verify correctness
-    swarm += to_string(file_content[file_name].size()) + " ";
-    for (auto hash : file_content[file_name]) {
-        swarm += hash + " ";
-    }
+    // and how many owners every segment has, so the client can get the rarest ones first
+    pack(swarm, &segment_count);
+    pack(swarm, block.availability.data(), segment_count);
 
     // send the response to the client
-    cerr << "[TRACKER]: Sending swarm for file " << file_name << " to " << source << endl;
-    size = swarm.size();
-    CHECK_MPI_RET(MPI_Send(&size, 1, MPI_INT, source, TRACKER_TAG, MPI_COMM_WORLD));
-    CHECK_MPI_RET(MPI_Send(swarm.c_str(), swarm.size(), MPI_CHAR, source, TRACKER_TAG, MPI_COMM_WORLD));
-}
-
-void Tracker::peer_update(int client_rank) {
-    int buf_size;
-    CHECK_MPI_RET(MPI_Recv(&buf_size, 1, MPI_INT, client_rank, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    char buf[buf_size + 1];
-    CHECK_MPI_RET(MPI_Recv(buf, buf_size, MPI_CHAR, client_rank, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    buf[buf_size] = '\0';
-    string file_name(buf);
-    if (swarms.find(file_name) == swarms.end()) {
-        swarms[file_name].push_back(client_rank);
-    }
-	/* Add the client to this file's peer list if isn't present already */
-	if (find(file_control_blocks[file_name].peers.begin(), file_control_blocks[file_name].peers.end(), client_rank) == file_control_blocks[file_name].peers.end()) {
-		file_control_blocks[file_name].peers.push_back(client_rank);
+    queue_reply(shard_of(file_id), move(swarm), source, TRACKER_TAG);
+}
+
+void Tracker::add_to_swarm(int file_id, int client_rank, bool seed) {
+    fcb &block = file_control_blocks[file_id];
+    if (!sorted_insert(block.swarm, client_rank) && !seed) {
+        return;
+    }
+    block.swarm_log.push_back(swarm_change{client_rank, seed ? SWARM_SEED : 1});
+    /* Only files that somebody subscribed to need a push, the
+     * changes are coalesced until next_notify_time
+     * Without subscribers there's nobody to push to, the future
+     * subscribers get the current swarm with their swarm request */
+    if (block.subscribers.empty()) {
+        block.notified_version = block.swarm_log.size();
+    } else if (!block.notify_queued) {
+        tracker_shard &shard = shard_of(file_id);
+        if (shard.notify_pending.empty()) {
+            shard.next_notify_time = MPI_Wtime() + notify_interval;
+        }
+        shard.notify_pending.push_back(file_id);
+        block.notify_queued = true;
+    }
+}
+
+void Tracker::add_availability(fcb &block, const vector<uint64_t> &old_bits, const vector<uint64_t> &new_bits) {
+    vector<int> &availability = block.availability;
+    for (int seg_idx = 0; seg_idx < (int)availability.size(); seg_idx++) {
+        int word = seg_idx / 64;
+        uint64_t mask = 1ULL << (seg_idx % 64);
+        bool had = word < (int)old_bits.size() && (old_bits[word] & mask);
+        bool has = word < (int)new_bits.size() && (new_bits[word] & mask);
+        if (has && !had) {
+            availability[seg_idx]++;
+        }
+    }
+}
+
+void Tracker::peer_update(int client_rank, int file_id, const vector<uint64_t> &bitfield) {
+    fcb &block = file_control_blocks[file_id];
+    add_to_swarm(file_id, client_rank);
+	/* Add the client to this file's peer list if it isn't a seed already */
+	if (!sorted_contains(block.seeds, client_rank)) {
+		sorted_insert(block.peers, client_rank);
 	}
+	/* Only the segments the client didn't report before are new owners */
+	vector<uint64_t> &old_bitfield = find_peer_bitfield(block, client_rank);
+	add_availability(block, old_bitfield, bitfield);
+	old_bitfield = bitfield;
 }
 
+/* Every client gives every tracker the part of its manifest the ring maps
+ * to it, the manifests are gathered with a single collective per tracker
+ * then parsed in the clients' order */
 void Tracker::receive_initial_files_from_clients() {
-    for (int r = 1; r < num_tasks; r++) {
-        seed_initial_update(r);
+    vector<int> sizes, displacements;
+    vector<vector<char>> no_parts(tracker_count);
+    vector<char> manifests = gather_to_trackers(no_parts, tracker_count, sizes, displacements);
+    for (int r = TRACKER_RANK + tracker_count; r < num_tasks; r++) {
+        if (sizes[r] > 0) {
+            parse_seed_file_list(manifests.data() + displacements[r], r);
+        }
     }
 }
 
-void Tracker::seed_initial_update(int source) {
-    int size;
-    CHECK_MPI_RET(MPI_Recv(&size, 1, MPI_INT, source, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    char buf[size + 1];
-    CHECK_MPI_RET(MPI_Recv(buf, size, MPI_CHAR, source, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    buf[size] = '\0';
-    /* Parse the file content */
-    string file_list(buf);
-    parse_seed_file_list(file_list, source);
+bool Tracker::is_home_client(int client_rank) {
+    return client_rank % tracker_count == rank - TRACKER_RANK;
+}
+
+/* Gathers every tracker's file table on all the trackers, the files get
+ * their ids in the trackers' order, so tracker t's files come after
+ * the files of the trackers before it */
+void Tracker::exchange_file_tables() {
+    vector<file_entry> own_files;
+    for (auto &block : file_control_blocks) {
+        own_files.push_back(make_file_entry(block.name, block.hashes.size()));
+    }
+
+    int own_bytes = own_files.size() * sizeof(file_entry);
+    vector<int> bytes(tracker_count), displacements(tracker_count, 0);
+    CHECK_MPI_RET(MPI_Allgather(&own_bytes, 1, MPI_INT, bytes.data(), 1, MPI_INT, tracker_comm));
+    for (int t = 1; t < tracker_count; t++) {
+        displacements[t] = displacements[t - 1] + bytes[t - 1];
+    }
+    int total_bytes = displacements[tracker_count - 1] + bytes[tracker_count - 1];
+
+    file_table.resize(total_bytes / sizeof(file_entry));
+    CHECK_MPI_RET(MPI_Allgatherv(own_files.data(), own_bytes, MPI_BYTE, file_table.data(),
+                                 bytes.data(), displacements.data(), MPI_BYTE, tracker_comm));
+
+    /* Move our blocks to their global ids */
+    int first_id = displacements[rank - TRACKER_RANK] / sizeof(file_entry);
+    vector<fcb> blocks(file_table.size());
+    for (int i = 0; i < (int)file_control_blocks.size(); i++) {
+        blocks[first_id + i] = move(file_control_blocks[i]);
+    }
+    file_control_blocks = move(blocks);
+
+    file_ids.clear();
+    for (int file_id = 0; file_id < (int)file_table.size(); file_id++) {
+        file_ids[file_table[file_id].name] = file_id;
+    }
 }
 
 /* Handles the signal from a client that it finished downloading 
  * a certain file and marks him as a seed for that file */
-void Tracker::download_completed(int client_rank) {
-    int size;
-    CHECK_MPI_RET(MPI_Recv(&size, 1, MPI_INT, client_rank, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    char buf[size + 1];
-    CHECK_MPI_RET(MPI_Recv(buf, size, MPI_CHAR, client_rank, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    buf[size] = '\0';
-    string file_name(buf);
-	file_control_blocks[file_name].seeds.push_back(client_rank);
+void Tracker::download_completed(int client_rank, int file_id) {
+    fcb &block = file_control_blocks[file_id];
+    /* The owners downloading this file stop sending it haves from now on */
+    add_to_swarm(file_id, client_rank, true);
+	/* The client now owns every segment, count the ones it didn't report yet */
+	vector<uint64_t> all_bits((block.availability.size() + 63) / 64, ~0ULL);
+	add_availability(block, find_peer_bitfield(block, client_rank), all_bits);
+	block.peer_bitfields.erase(lower_bound(block.peer_bitfields.begin(), block.peer_bitfields.end(), client_rank,
+		[](const peer_bitfield &entry, int r) { return entry.rank < r; }));
+	/* The client doesn't need the swarm's changes anymore */
+	sorted_erase(block.subscribers, client_rank);
+	sorted_insert(block.seeds, client_rank);
 	/* Now remove the client from the file's peer list as it is now a seed */
-	file_control_blocks[file_name].peers.erase(
-		remove(file_control_blocks[file_name].peers.begin(), file_control_blocks[file_name].peers.end(), client_rank),
-		file_control_blocks[file_name].peers.end()
-	);
+	sorted_erase(block.peers, client_rank);
 }
 
 void Tracker::all_downloads_completed(int source) {
     // update the number of clients that finished downloading all their files
-    cerr << "[TRACKER]: Peer " << source << " finished downloading all files." << endl;
     clients_done++;
 }
 
-void Tracker::parse_seed_file_list(string file_list, int rank) {
-    stringstream ss(file_list);
-
-    string file_name;
-    string segment_hash;
-    int files_nr;
-    int segment_nr;
-
-    ss >> files_nr;
-    while (ss >> file_name) {
-        swarms[file_name].push_back(rank);
-		file_control_blocks[file_name].seeds.push_back(rank);
-        ss >> segment_nr;
-        if (!file_content[file_name].empty()) {
-            for (int i = 1; i <= segment_nr; i++) {
-                ss >> segment_hash;
-            }
-            continue;    
+/* Interns a file's name, the files get their ids in the order they are first seen */
+int Tracker::register_file(const string &file_name) {
+    auto it = file_ids.find(file_name);
+    if (it != file_ids.end()) {
+        return it->second;
+    }
+    int file_id = file_control_blocks.size();
+    file_ids.emplace(file_name, file_id);
+    file_control_blocks.emplace_back();
+    file_control_blocks.back().name = file_name;
+    return file_id;
+}
+
+/* Parses a seed's manifest: [header(count = files)] followed, for every
+ * file, by [file_entry][segment_hash x segment_count][int digest_count]
+ * [uint64_t digest x digest_count] */
+void Tracker::parse_seed_file_list(const char *file_list, int rank) {
+    const char *cursor = file_list;
+    msg_header header;
+    unpack(cursor, &header);
+
+    for (int i = 0; i < header.count; i++) {
+        file_entry entry;
+        unpack(cursor, &entry);
+        int file_id = register_file(entry.name);
+
+        add_to_swarm(file_id, rank, true);
+		fcb &block = file_control_blocks[file_id];
+		sorted_insert(block.seeds, rank);
+		/* A seed owns every segment of the file */
+		block.availability.resize(entry.segment_count, 0);
+		for (auto &owners : block.availability) {
+			owners++;
+		}
+        if (!block.hashes.empty()) {
+            cursor += entry.segment_count * sizeof(segment_hash);
+        } else {
+            block.hashes.resize(entry.segment_count);
+            unpack(cursor, block.hashes.data(), entry.segment_count);
         }
-        for (int i = 1; i <= segment_nr; i++) {
-            ss >> segment_hash;
-            file_content[file_name].push_back(segment_hash);
+
+        int digest_count;
+        unpack(cursor, &digest_count);
+        if (!block.digests.empty()) {
+            cursor += digest_count * sizeof(uint64_t);
+            continue;
         }
+        block.digests.resize(digest_count);
+        unpack(cursor, block.digests.data(), digest_count);
     }
 }
@@ -1,61 +1,173 @@
 #pragma once
 
 #include "utils.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "trace.h"
 
 using namespace std;
 
+/* The last ownership bitfield a peer reported for a file */
+typedef struct {
+    int rank;
+    vector<uint64_t> bits;
+} peer_bitfield;
+
+/* File control block, everything the tracker knows about a file, kept
+ * in a single record per file id
+ * All the rank lists are sorted, so membership is a binary search */
+typedef struct {
+    string name;
+    /* The file's hashes; when a client requests the file's swarm for the
+     * first time, the tracker will send it along with all the hashes, so the
+     * client knows what hashes it needs to request from peers/seeds. */
+    vector<segment_hash> hashes;
+    /* The digests of the segments' payloads, as computed by the seeds,
+     * sent along with the hashes so the clients can verify the payloads
+     * they receive; empty if only the hashes move */
+    vector<uint64_t> digests;
+    /* The swarm: every peer / seed that owns the file (in part or fully) */
+    vector<int> swarm;
+    vector<int> seeds;
+    vector<int> peers;
+    /* Sorted by rank */
+    vector<peer_bitfield> peer_bitfields;
+    /* How many owners every segment has */
+    vector<int> availability;
+    /* Every change of the file's swarm, the swarm's version is the
+     * number of changes, so a client that saw version v only needs
+     * the changes from v onwards */
+    vector<swarm_change> swarm_log;
+    /* The clients that get the swarm's changes pushed, the version
+     * up to which the changes were pushed and whether a push is queued */
+    vector<int> subscribers;
+    int notified_version = 0;
+    bool notify_queued = false;
+} fcb;
+
+/* A tracker worker thread's state, the shard owns the files whose
+ * id % shard_count is its index and receives their requests on its own tag
+ * Only its thread touches the shard and the files it owns, so no locks */
+typedef struct {
+    int tag;
+    /* How many clients signaled this shard that they're done */
+    int clients_done = 0;
+    /* How many requests the shard handled */
+    long long handled_requests = 0;
+    /* Replies that were sent with MPI_Isend and may still be in flight,
+     * each buffer is kept alive until its send completes */
+    vector<MPI_Request> reply_reqs;
+    vector<vector<char>> reply_bufs;
+    /* Files whose swarm changed since the last push to the subscribers,
+     * the changes are pushed once notify_interval passed since the first one */
+    vector<int> notify_pending;
+    double next_notify_time = 0;
+} tracker_shard;
+
 class Tracker {
 private:
 	int num_tasks;
-	/* Counter for how many clients finished downloading all their wanted files */
+	int rank;
+	/* The trackers are ranks TRACKER_RANK .. TRACKER_RANK + tracker_count - 1,
+	 * the clients are all the ranks after them */
+	int tracker_count;
+	MPI_Comm tracker_comm;
+	/* Counter for how many of this tracker's home clients finished downloading
+	 * all their wanted files, kept by the coordinator (the main thread) */
 	int clients_done = 0;
 
-	/* Stores each file's hashes; when a client requests a certain file's swarm, 
-	 * the tracker will send it along with all that file's hashes, so the client 
-	 * knows what hashes it needs to request from peers/seeds. */
-	unordered_map<string, vector<string>> file_content;
-
-	/* Stores a list of associated peers/seeds for a certain file */
-    unordered_map<string, vector<int>> swarms;
+	/* Every file's control block, indexed by the file's id
+	 * The names are interned into ids once, as the files get registered;
+	 * the ids are sent to the clients along with the initial ACK and
+	 * every request after it refers to a file by its id
+	 * Every tracker registers only the files the ring maps to it, then
+	 * the trackers merge their tables, so the ids are the same everywhere;
+	 * the blocks of the files other trackers own stay empty */
+	vector<fcb> file_control_blocks;
+	unordered_map<string, int> file_ids;
+	/* Every file's name and segment count, sent with the ACK */
+	vector<file_entry> file_table;
 
-	/* Stores a file's list of peers and seeds */
-	unordered_map<string, fcb> file_control_blocks;
+	/* The files are split between shard_count worker threads, created
+	 * once the files are registered */
+	int shard_count;
+	vector<tracker_shard> shards;
+	tracker_shard &shard_of(int file_id);
+	void split_files_into_shards();
 
 	/* Handles a swarm requests from clients */
-	void swarm_req(int client_rank);
+	void swarm_req(int client_rank, int file_id, int known_version, bool subscribe);
 	
 	/* Sends an ACK to the initial clients so they can start their download/upload threads */
 	void acknowledge_initial_files();
 
+	double notify_interval;
+
 	/* Tracks and mediates swarms during the downloading phase */
 	void start_mediating_the_swarms();
 
+	/* A shard's event loop */
+	void shard_thread_func(tracker_shard &shard);
+
+	/* Waits for a request, but only until the pending notifications are due */
+	bool wait_for_request(tracker_shard &shard, vector<char> &request, MPI_Status *status);
+
+	/* Pushes the coalesced swarm changes to every file's subscribers */
+	void flush_notifications(tracker_shard &shard);
+
+	/* Handles a single request from a client */
+	void dispatch_request(tracker_shard &shard, int client_rank, const vector<char> &request);
+
+	/* Sends a reply without waiting for it to be delivered, a synchronous
+	 * one only completes once the client received it */
+	void queue_reply(tracker_shard &shard, vector<char> &&buf, int dest, int tag, bool synchronous = false);
+
+	/* Frees the replies that were delivered, or waits for all of them */
+	void flush_replies(tracker_shard &shard, bool wait_all);
+
 	/* Signals all peers/seeds to terminate after all clients finished their downloading phase */
 	void signal_all_seeds_to_terminate();
 
-	/* Handles the initial update from seeds */
-	void seed_initial_update(int source);
+	/* Appends the changes of a file's swarm since known_version to a message buffer */
+	void pack_file_swarm(int file_id, int known_version, vector<char> &buf);
+
+	/* Updates the peer list and the segment availability when a client reports
+	 * the segments it got from a file */
+	void peer_update(int client_rank, int file_id, const vector<uint64_t> &bitfield);
 
-	/* Retrieves and constructs a file's swarm as a string */
-	string get_file_swarm(string file_name);
+	/* Counts the segments set in new_bits but not in old_bits as available */
+	void add_availability(fcb &block, const vector<uint64_t> &old_bits, const vector<uint64_t> &new_bits);
 
-	/* Updates the peer list when a new client gets a file */
-	void peer_update(int client_rank);
+	/* Adds a client to a file's swarm if it isn't present already, a seed's
+	 * change is logged even if it was, the owners learn it has every segment */
+	void add_to_swarm(int file_id, int client_rank, bool seed = false);
+
+	/* Interns a file's name, returns its id */
+	int register_file(const string &file_name);
 	
 	/* Receives the initial files from all clients */
 	void receive_initial_files_from_clients();
 
+	/* Merges the trackers' file tables, assigning the global file ids */
+	void exchange_file_tables();
+
+	/* A client's home tracker counts and terminates it */
+	bool is_home_client(int client_rank);
+
 	/* Handles a signal from a client that it finished downloading a file */
-	void download_completed(int client_rank);
+	void download_completed(int client_rank, int file_id);
 	
 	/* Handles case when a client has finished downloading all files */
 	void all_downloads_completed(int client_rank);
 	
 	/* Parses the initial file list from a seeding client */
-	void parse_seed_file_list(string file_list, int rank);
+	void parse_seed_file_list(const char *file_list, int rank);
 
 public:
-	Tracker(int numtasks) : num_tasks(numtasks) {}
+	Tracker(int numtasks, int rank, int tracker_count, MPI_Comm tracker_comm) :
+		num_tasks(numtasks), rank(rank), tracker_count(tracker_count), tracker_comm(tracker_comm),
+		shard_count(get_config_value("TRACKER_SHARDS", DEFAULT_TRACKER_SHARDS)),
+		notify_interval(get_config_value("NOTIFY_INTERVAL_US", DEFAULT_NOTIFY_INTERVAL_US) / 1e6) {}
 
 	void init();
 };
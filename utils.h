@@ -2,16 +2,20 @@
 
 #include <mpi.h>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <thread>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <unistd.h>
 #include <unordered_map>
 #include <sstream>
 #include <algorithm>
 #include <iostream>
+#include <random>
 
 using namespace std;
 
@@ -38,23 +42,103 @@ static void check_mpi_error(const char* call, int ret, const char* file, int lin
                         __FILE__, __LINE__); \
     } while (0)
 
+/* Log levels, the per-segment and per-request logs are only compiled in
+ * at LOG_LEVEL_DEBUG (make LOG_LEVEL=2), the hot paths don't pay for them
+ * otherwise */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_DEBUG 2
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_DEBUG(expr)                         \
+    do {                                        \
+        if (LOG_LEVEL >= LOG_LEVEL_DEBUG) {     \
+            cerr << expr << endl;               \
+        }                                       \
+    } while (0)
+
 
 enum Constants {
+    /* The first tracker, the others follow it */
     TRACKER_RANK = 0,
     ACK = 1,
+    /* Sent instead of an ACK / NACK by an owner whose upload queue is full */
+    BUSY = 2,
     SWARM_REQUEST = 55,
     PEER_UPDATE = 44,
     SINGLE_FILE_DOWNLOAD_COMPLETED = 33,
     CLIENT_GOT_ALL_FILES = 22,
+    INITIAL_FILES = 66,
+    SEGMENT_REQUEST = 77,
+    TERMINATE = 88,
+    SWARM_NOTIFY = 99,
+    /* Gossip between the owners downloading the same file: the segments
+     * acquired since the last HAVE, or the whole bitfield (HAVE_BITFIELD) */
+    HAVE = 11,
+    HAVE_BITFIELD = 12,
+    /* A swarm change's added value for an owner that has every segment */
+    SWARM_SEED = 2,
+    /* Set in a swarm request's tag to get the swarm's changes pushed */
+    SUBSCRIBE = 1,
     TRACKER_TAG = 1,
-    DOWNLOAD_TAG = 2,
-    UPLOAD_TAG = 3
+    /* The requests about a file go to the tracker shard that owns it,
+     * on TRACKER_SHARD_TAG + shard */
+    TRACKER_SHARD_TAG = 5,
+    UPLOAD_TAG = 3,
+    /* The tracker pushes the swarm changes to the subscribed clients on this tag */
+    SWARM_NOTIFY_TAG = 4,
+    /* The owners gossip their segments to each other on this tag */
+    HAVE_TAG = 2,
+    /* Segment responses are sent back on SEGMENT_RESPONSE_TAG + window slot,
+     * so the downloader can match an answer to its outstanding request */
+    SEGMENT_RESPONSE_TAG = 100,
+    /* Default number of segment requests a peer keeps in flight */
+    DEFAULT_DOWNLOAD_WINDOW = 8,
+    /* Default number of upload workers serving segment requests */
+    DEFAULT_UPLOAD_WORKERS = 2,
+    /* Default number of queued segment requests above which an owner answers BUSY */
+    DEFAULT_UPLOAD_QUEUE_LIMIT = 64,
+    /* Default size, in bytes, of a segment's payload; 0 means only the
+     * hashes move, there's no payload */
+    DEFAULT_SEGMENT_SIZE = 0,
+    /* Default number of workers verifying the received payloads */
+    DEFAULT_VERIFY_WORKERS = 2,
+    /* Default number of wanted files downloaded at once */
+    DEFAULT_CONCURRENT_FILES = 4,
+    /* Default number of owners a segment is requested from at once, once all
+     * of its file's remaining segments are in flight (the endgame) */
+    DEFAULT_ENDGAME_REQUESTS = 2,
+    /* Default time window, in microseconds, over which the tracker
+     * coalesces the swarm changes it pushes */
+    DEFAULT_NOTIFY_INTERVAL_US = 2000,
+    /* Default number of tracker worker threads, each one owning a shard of the files */
+    DEFAULT_TRACKER_SHARDS = 2,
+    /* Default number of ranks acting as trackers, ranks 0 .. TRACKERS - 1 */
+    DEFAULT_TRACKERS = 1,
+    /* Points every tracker gets on the consistent hashing ring */
+    RING_VIRTUAL_NODES = 64,
+    /* A client re-orders the segments it still has to request by their
+     * availability every this many downloaded segments */
+    AVAILABILITY_REFRESH_SEGMENTS = 50,
+    /* A client sends a HAVE for a file every this many acquired segments */
+    HAVE_BATCH_SEGMENTS = 4,
+    /* How many times a segment is requested from every owner before giving up */
+    SEGMENT_ATTEMPT_ROUNDS = 3,
+    /* Default number of spans a thread keeps when tracing, the oldest
+     * ones are overwritten past it */
+    DEFAULT_TRACE_BUFFER_EVENTS = 65536
 };
 
-
-/* File control block for a file 
- * contains a list of this file's seeds and peers */
-typedef struct {
-    vector<int> seeds;
-    vector<int> peers;
-} fcb;
\ No newline at end of file
+/* Reads an integer tunable from the environment, falls back to
+ * the given default if it isn't set or isn't a positive number */
+static inline int get_config_value(const char *name, int default_value) {
+    const char *value = getenv(name);
+    if (value == NULL) {
+        return default_value;
+    }
+    int parsed = atoi(value);
+    return parsed > 0 ? parsed : default_value;
+}